@@ -1,258 +1,6066 @@
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <new>
 #include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOA_X86_KERNELS 1
+#endif
 
 // Simple random number generator class
+//
+// xoshiro256** seeded through splitmix64. Every broker owns its own
+// generator, derived from the master seed and its broker id, so order
+// generation shares no state between threads and a seed always replays the
+// same order stream per broker.
 class SimpleRandom {
 private:
-    unsigned long state;
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    static uint64_t splitMix(uint64_t& x) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
 
 public:
-    SimpleRandom(unsigned long seed = 12345) : state(seed) {}
+    SimpleRandom(uint64_t seed = 12345, uint64_t stream = 0) {
+        uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+        for (int i = 0; i < 4; i++) state[i] = splitMix(x);
+    }
 
-    unsigned long nextInt() {
-        const unsigned long a = 1664525;
-        const unsigned long c = 1013904223;
-        state = (a * state + c) % 0xFFFFFFFF;
-        return state;
+    uint64_t nextInt() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
     }
 
+    // Multiply-shift range reduction instead of a modulo.
     int randInt(int low, int high) {
-        int range = high - low + 1;
-        return low + (nextInt() % range);
+        uint64_t range = (uint64_t)(high - low) + 1;
+        return low + (int)(((nextInt() >> 32) * range) >> 32);
     }
 
     double uniform(double low, double high) {
-        double randFloat = nextInt() / (double)0xFFFFFFFF;
+        double randFloat = (nextInt() >> 11) * (1.0 / 9007199254740992.0);
         return low + (randFloat * (high - low));
     }
 };
 
-SimpleRandom rng;
+// Cache-line aligned arrays. Plain new[] ignores alignas beyond the default
+// alignment before C++17, so over-aligned types are allocated through here.
+const int CACHE_LINE_SIZE = 64;
+
+template <typename T>
+T* newAlignedArray(size_t count) {
+    void* mem = nullptr;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(T) * count) != 0) {
+        throw std::bad_alloc();
+    }
+    T* items = static_cast<T*>(mem);
+    for (size_t i = 0; i < count; i++) new (&items[i]) T();
+    return items;
+}
+
+template <typename T>
+void deleteAlignedArray(T* items, size_t count) {
+    if (!items) return;
+    for (size_t i = 0; i < count; i++) items[i].~T();
+    free(items);
+}
+
+// Monotonic clock in nanoseconds.
+uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 // Constants and TickerString class
-const int NUM_TICKERS = 1024;
+const int DEFAULT_NUM_BOOKS = 1024;
 const int MAX_TICKER_LENGTH = 16;
-const double MAX_DOUBLE = 1e308;
+const double DEFAULT_TICK_SIZE = 0.01;
 
 class TickerString {
 private:
     char data[MAX_TICKER_LENGTH];
 
 public:
-    TickerString() { data[0] = '\0'; }
+    TickerString() { memset(data, 0, sizeof(data)); }
 
+    // Unused bytes are zeroed so that a ticker compares and hashes as two
+    // 64-bit words.
     TickerString(const char* str) {
         int i = 0;
         while (str[i] != '\0' && i < MAX_TICKER_LENGTH - 1) {
             data[i] = str[i];
             i++;
         }
-        data[i] = '\0';
+        memset(data + i, 0, MAX_TICKER_LENGTH - i);
     }
 
     const char* c_str() const { return data; }
 
     char operator[](int index) const { return data[index]; }
+
+    uint64_t word(int index) const {
+        uint64_t w;
+        memcpy(&w, data + index * sizeof(w), sizeof(w));
+        return w;
+    }
+};
+
+// TickerIndex
+//
+// Perfect hash from the ticker universe to dense book indices, built once at
+// startup (hash-and-displace). A ticker picks a bucket with a fixed seed and
+// then a slot with its bucket's displacement; construction searches a
+// displacement per bucket so that no two tickers share a slot. Lookups hash
+// the two key words twice and compare the stored key without branching, and
+// tickers outside the universe map to -1, so every symbol owns exactly one
+// book.
+class TickerIndex {
+private:
+    struct Slot {
+        uint64_t key[2];
+        int index;
+    };
+
+    static const uint64_t BUCKET_SEED = 0x2545F4914F6CDD1DULL;
+    static const uint32_t MAX_DISPLACEMENT = 1u << 24;
+
+    Slot* slots;
+    uint32_t* displacements;
+    uint64_t slotMask;
+    uint64_t bucketMask;
+
+    static uint64_t hashWords(uint64_t a, uint64_t b, uint64_t seed) {
+        uint64_t h = (a ^ seed) * 0x9E3779B97F4A7C15ULL;
+        h ^= (b + (h >> 29)) * 0xC2B2AE3D27D4EB4FULL;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint64_t nextPowerOfTwo(uint64_t n) {
+        uint64_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    void release() {
+        delete[] slots;
+        delete[] displacements;
+        slots = nullptr;
+        displacements = nullptr;
+    }
+
+public:
+    TickerIndex() : slots(nullptr), displacements(nullptr), slotMask(0), bucketMask(0) {}
+    ~TickerIndex() { release(); }
+
+    // Returns false when the universe contains duplicates or no displacement
+    // could be found.
+    bool build(const TickerString* universe, int count) {
+        release();
+        uint64_t slotCount = nextPowerOfTwo(2 * (uint64_t)count + 1);
+        uint64_t bucketCount = nextPowerOfTwo(count / 2 + 1);
+        slotMask = slotCount - 1;
+        bucketMask = bucketCount - 1;
+        slots = new Slot[slotCount];
+        displacements = new uint32_t[bucketCount];
+        for (uint64_t i = 0; i < slotCount; i++) {
+            slots[i].key[0] = slots[i].key[1] = 0;
+            slots[i].index = -1;
+        }
+
+        // Group keys by bucket, then place the largest buckets first.
+        int* bucketStart = new int[bucketCount + 1]();
+        int* keysByBucket = new int[count];
+        int maxBucketSize = 0;
+        for (int i = 0; i < count; i++) {
+            uint64_t bucket = hashWords(universe[i].word(0), universe[i].word(1), BUCKET_SEED) & bucketMask;
+            bucketStart[bucket + 1]++;
+        }
+        for (uint64_t b = 0; b < bucketCount; b++) {
+            if (bucketStart[b + 1] > maxBucketSize) maxBucketSize = bucketStart[b + 1];
+            bucketStart[b + 1] += bucketStart[b];
+        }
+        int* fill = new int[bucketCount];
+        for (uint64_t b = 0; b < bucketCount; b++) fill[b] = bucketStart[b];
+        for (int i = 0; i < count; i++) {
+            uint64_t bucket = hashWords(universe[i].word(0), universe[i].word(1), BUCKET_SEED) & bucketMask;
+            keysByBucket[fill[bucket]++] = i;
+        }
+        delete[] fill;
+
+        bool* occupied = new bool[slotCount]();
+        uint64_t* candidate = new uint64_t[maxBucketSize + 1];
+        bool ok = true;
+        for (int size = maxBucketSize; size >= 0 && ok; size--) {
+            for (uint64_t b = 0; b < bucketCount && ok; b++) {
+                int first = bucketStart[b];
+                if (bucketStart[b + 1] - first != size) continue;
+                displacements[b] = 0;
+                if (size == 0) continue;
+                uint32_t d = 1;
+                for (; d < MAX_DISPLACEMENT; d++) {
+                    bool fits = true;
+                    for (int k = 0; k < size && fits; k++) {
+                        const TickerString& key = universe[keysByBucket[first + k]];
+                        candidate[k] = hashWords(key.word(0), key.word(1), d) & slotMask;
+                        if (occupied[candidate[k]]) fits = false;
+                        for (int j = 0; j < k && fits; j++) {
+                            if (candidate[j] == candidate[k]) fits = false;
+                        }
+                    }
+                    if (fits) break;
+                }
+                if (d == MAX_DISPLACEMENT) {
+                    ok = false;
+                    break;
+                }
+                displacements[b] = d;
+                for (int k = 0; k < size; k++) {
+                    int keyIndex = keysByBucket[first + k];
+                    occupied[candidate[k]] = true;
+                    slots[candidate[k]].key[0] = universe[keyIndex].word(0);
+                    slots[candidate[k]].key[1] = universe[keyIndex].word(1);
+                    slots[candidate[k]].index = keyIndex;
+                }
+            }
+        }
+        delete[] candidate;
+        delete[] occupied;
+        delete[] keysByBucket;
+        delete[] bucketStart;
+        if (!ok) {
+            release();
+        }
+        return ok;
+    }
+
+    int lookup(const TickerString& ticker) const {
+        uint64_t a = ticker.word(0);
+        uint64_t b = ticker.word(1);
+        uint32_t d = displacements[hashWords(a, b, BUCKET_SEED) & bucketMask];
+        const Slot& slot = slots[hashWords(a, b, d) & slotMask];
+        int match = -(int)((slot.key[0] == a) & (slot.key[1] == b));
+        return (slot.index & match) | ~match;
+    }
 };
 
+TickerIndex tickerIndex;
+
 // Order types and Order class
 enum OrderType { BUY, SELL };
 
+// Fill state packs an order's quantity into one CAS word: the low 32 bits are
+// available to match, the high 32 bits are reserved by fills in flight. A fill
+// moves quantity from available to reserved on both orders before committing,
+// so no two matchers can ever take the same shares. Quantities fit in 31
+// bits, so the top bit is free to mark a cancelled order: reserved shares it
+// gets back are discarded instead of becoming available again.
+const uint64_t FILL_CANCELLED = (uint64_t)1 << 63;
+
+inline int availableOf(uint64_t state) { return (int)(uint32_t)state; }
+inline int reservedOf(uint64_t state) { return (int)((state & ~FILL_CANCELLED) >> 32); }
+// True once nothing is available or reserved; the cancelled mark may remain.
+inline bool fillsDone(uint64_t state) { return (state & ~FILL_CANCELLED) == 0; }
+
 class Order {
 public:
     OrderType orderType;
     TickerString ticker;
-    volatile int quantity;
-    double price;
-    int orderId;
+    volatile uint64_t fillState;
+    uint64_t orderId;
+    int priceTicks;
+    // Place in its level's queue, stamped by OrderList::append; compare with
+    // queueBefore, which tolerates wrap-around.
+    uint32_t queuePosition;
+
+    Order(OrderType type, const TickerString& tkr, int qty, int ticks, uint64_t id)
+        : orderType(type), ticker(tkr), fillState((uint32_t)qty), orderId(id), priceTicks(ticks), queuePosition(0) {}
+
+    int availableQuantity() const { return availableOf(fillState); }
+    // Available plus reserved: what the order still holds on its level.
+    int openQuantity() const { uint64_t state = fillState; return availableOf(state) + reservedOf(state); }
+};
+
+inline bool queueBefore(uint32_t position, uint32_t other) { return (int32_t)(position - other) < 0; }
+
+// Order ids
+//
+// Ids are 64-bit: a sequence number above ORDER_SOURCE_BITS bits naming the
+// broker that entered the order, so fills can be routed back without a
+// lookup. Each thread leases blocks of ORDER_ID_BLOCK sequence numbers from
+// one global counter and hands them out locally, which keeps ids unique and
+// monotonic per thread at the cost of one atomic add per block. Threads that
+// never called setOrderSource() use ORDER_SOURCE_NONE.
+const int ORDER_SOURCE_BITS = 8;
+const int ORDER_SOURCE_NONE = (1 << ORDER_SOURCE_BITS) - 1;
+const uint64_t ORDER_ID_BLOCK = 1024;
+
+volatile uint64_t nextOrderIdBlock = 1;
+
+struct OrderIdLease {
+    uint64_t next;
+    uint64_t end;
+    int source;
+
+    OrderIdLease() : next(0), end(0), source(ORDER_SOURCE_NONE) {}
+};
+
+thread_local OrderIdLease orderIdLease;
+
+// Brokers 0..ORDER_SOURCE_NONE-1 get their own source; anything else is
+// folded into ORDER_SOURCE_NONE.
+void setOrderSource(int source) {
+    orderIdLease.source = (source >= 0 && source < ORDER_SOURCE_NONE) ? source : ORDER_SOURCE_NONE;
+}
+
+uint64_t nextOrderId() {
+    OrderIdLease& lease = orderIdLease;
+    if (lease.next == lease.end) {
+        lease.next = __sync_fetch_and_add(&nextOrderIdBlock, 1) * ORDER_ID_BLOCK;
+        lease.end = lease.next + ORDER_ID_BLOCK;
+    }
+    return (lease.next++ << ORDER_SOURCE_BITS) | (uint64_t)lease.source;
+}
 
-    Order(OrderType type, const TickerString& tkr, int qty, double prc)
-        : orderType(type), ticker(tkr), quantity(qty), price(prc) {
-        orderId = rng.randInt(1, 1000000);
+inline int orderSourceOf(uint64_t orderId) { return (int)(orderId & ORDER_SOURCE_NONE); }
+
+// Moves the block counter past orderId, so ids restored from disk are never
+// handed out again. Leases already taken are not affected.
+void reserveOrderIdsThrough(uint64_t orderId) {
+    uint64_t block = (orderId >> ORDER_SOURCE_BITS) / ORDER_ID_BLOCK + 1;
+    uint64_t seen = nextOrderIdBlock;
+    while (seen < block && !__sync_bool_compare_and_swap(&nextOrderIdBlock, seen, block)) {
+        seen = nextOrderIdBlock;
     }
+}
+
+// Epoch-based reclamation
+//
+// Threads enter an EpochGuard before touching shared nodes. Unlinked nodes are
+// retired into a per-thread bag tagged with the retiring thread's epoch and
+// freed once the global epoch is two steps ahead, i.e. once every thread that
+// could still hold a reference has left its critical section.
+const int MAX_EPOCH_THREADS = 128;
+const int RETIRE_BATCH = 64;
+
+typedef void (*Reclaimer)(void*);
+
+struct RetiredItem {
+    void* ptr;
+    Reclaimer reclaim;
 };
 
-// OrderNode and OrderList classes
-struct OrderNode {
-    Order order;
-    volatile OrderNode* next;
-    OrderNode(const Order& ord) : order(ord), next(nullptr) {}
+struct RetireBag {
+    RetiredItem* items;
+    int count;
+    int capacity;
+    unsigned long epoch;
+    RetireBag* next;
+
+    RetireBag() : items(nullptr), count(0), capacity(0), epoch(0), next(nullptr) {}
+
+    void push(void* ptr, Reclaimer reclaim) {
+        if (count == capacity) {
+            int newCapacity = capacity ? capacity * 2 : RETIRE_BATCH;
+            RetiredItem* grown = new RetiredItem[newCapacity];
+            for (int i = 0; i < count; i++) grown[i] = items[i];
+            delete[] items;
+            items = grown;
+            capacity = newCapacity;
+        }
+        items[count].ptr = ptr;
+        items[count].reclaim = reclaim;
+        count++;
+    }
+
+    void reclaimAll() {
+        for (int i = 0; i < count; i++) items[i].reclaim(items[i].ptr);
+        count = 0;
+    }
 };
 
-class OrderList {
+struct alignas(CACHE_LINE_SIZE) EpochSlot {
+    volatile unsigned long state; // (epoch << 1) | active
+    volatile int claimed;
+};
+
+EpochSlot epochSlots[MAX_EPOCH_THREADS];
+volatile unsigned long globalEpoch = 0;
+RetireBag* volatile orphanBags = nullptr;
+
+void pushOrphanBag(RetireBag* bag) {
+    RetireBag* oldHead;
+    do {
+        oldHead = orphanBags;
+        bag->next = oldHead;
+    } while (!__sync_bool_compare_and_swap(&orphanBags, oldHead, bag));
+}
+
+// Frees orphaned bags (left behind by exited threads) that are old enough.
+void reclaimOrphanBags(unsigned long epoch) {
+    RetireBag* bag = __sync_lock_test_and_set(&orphanBags, (RetireBag*)nullptr);
+    while (bag) {
+        RetireBag* next = bag->next;
+        if (bag->epoch + 2 <= epoch) {
+            bag->reclaimAll();
+            delete[] bag->items;
+            delete bag;
+        } else {
+            pushOrphanBag(bag);
+        }
+        bag = next;
+    }
+}
+
+bool tryAdvanceEpoch() {
+    unsigned long epoch = globalEpoch;
+    for (int i = 0; i < MAX_EPOCH_THREADS; i++) {
+        unsigned long state = epochSlots[i].state;
+        if ((state & 1) && (state >> 1) != epoch) {
+            return false;
+        }
+    }
+    if (__sync_bool_compare_and_swap(&globalEpoch, epoch, epoch + 1)) {
+        reclaimOrphanBags(epoch + 1);
+    }
+    return true;
+}
+
+class EpochThread {
 private:
-    volatile OrderNode* head;
+    int slot;
+    int nesting;
+    int sinceAdvance;
+    unsigned long localEpoch;
+    RetireBag bags[3];
+
+    void claimSlot() {
+        while (true) {
+            for (int i = 0; i < MAX_EPOCH_THREADS; i++) {
+                if (!epochSlots[i].claimed && __sync_bool_compare_and_swap(&epochSlots[i].claimed, 0, 1)) {
+                    slot = i;
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void reclaimBags(unsigned long epoch) {
+        for (int i = 0; i < 3; i++) {
+            if (bags[i].count && bags[i].epoch + 2 <= epoch) {
+                bags[i].reclaimAll();
+            }
+        }
+    }
 
 public:
-    OrderList() : head(nullptr) {}
+    EpochThread() : slot(-1), nesting(0), sinceAdvance(0), localEpoch(0) {}
+
+    ~EpochThread() {
+        for (int i = 0; i < 3; i++) {
+            if (bags[i].count) {
+                RetireBag* orphan = new RetireBag(bags[i]);
+                bags[i].items = nullptr;
+                pushOrphanBag(orphan);
+            }
+            delete[] bags[i].items;
+        }
+        if (slot >= 0) {
+            epochSlots[slot].state = 0;
+            __sync_lock_release(&epochSlots[slot].claimed);
+        }
+    }
 
-    OrderNode* append(const Order& order) {
-        OrderNode* newNode = new OrderNode(order);
-        OrderNode* oldHead;
+    void enter() {
+        if (nesting++ > 0) {
+            return;
+        }
+        if (slot < 0) {
+            claimSlot();
+        }
+        unsigned long epoch;
         do {
-            oldHead = const_cast<OrderNode*>(head);
-            newNode->next = oldHead;
-        } while (!__sync_bool_compare_and_swap(&head, oldHead, newNode));
-        return newNode;
+            epoch = globalEpoch;
+            epochSlots[slot].state = (epoch << 1) | 1;
+            __sync_synchronize();
+        } while (globalEpoch != epoch);
+        localEpoch = epoch;
+        reclaimBags(epoch);
     }
 
-    volatile OrderNode* getHead() const { return head; }
-};
+    void exit() {
+        if (--nesting == 0) {
+            __atomic_store_n(&epochSlots[slot].state, localEpoch << 1, __ATOMIC_RELEASE);
+        }
+    }
 
-// OrderBook class with matching logic
-class OrderBook {
-private:
-    OrderList buyOrders;
-    OrderList sellOrders;
+    // Must be called inside a guard, after ptr has been unlinked. The item is
+    // tagged with the global epoch seen after the unlink rather than this
+    // thread's entry epoch, which may be one behind: a thread that entered in
+    // the later epoch can still hold ptr.
+    void retire(void* ptr, Reclaimer reclaim) {
+        unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+        RetireBag& bag = bags[epoch % 3];
+        if (bag.epoch != epoch) {
+            bag.reclaimAll();
+            bag.epoch = epoch;
+        }
+        bag.push(ptr, reclaim);
+        if (++sinceAdvance >= RETIRE_BATCH) {
+            sinceAdvance = 0;
+            tryAdvanceEpoch();
+        }
+    }
 
-    Order* findBestOpposite(const Order& order, const OrderList& oppositeOrders);
+    // Only safe once no other thread is inside a guard.
+    void drain() {
+        for (int i = 0; i < 3; i++) bags[i].reclaimAll();
+    }
+};
 
+thread_local EpochThread epochThread;
+
+class EpochGuard {
 public:
-    void addOrder(const Order& newOrder) {
-        OrderList& orders = (newOrder.orderType == BUY) ? buyOrders : sellOrders;
-        OrderList& oppositeOrders = (newOrder.orderType == BUY) ? sellOrders : buyOrders;
+    EpochGuard() { epochThread.enter(); }
+    ~EpochGuard() { epochThread.exit(); }
+};
 
-        OrderNode* newNode = orders.append(newOrder);
+void drainEpochs() {
+    epochThread.drain();
+    reclaimOrphanBags(~0UL);
+}
 
-        while (newNode->order.quantity > 0) {
-            Order* bestOpposite = findBestOpposite(newNode->order, oppositeOrders);
-            if (!bestOpposite || bestOpposite->quantity <= 0) {
-                break;
-            }
+// NUMA placement
+//
+// With NUMA placement on, book index i belongs to node i % nodeCount. Books
+// and order-node slabs are carved from per-node arenas whose pages are bound
+// to their node with mbind before first touch, and the threads that match a
+// partition are pinned to its node's CPUs, so a shard only walks memory on
+// its own socket. Each thread remembers its node in threadNumaNode, which
+// picks the arena and node depot its allocations use; threads that never
+// entered a node use node 0. The topology comes from
+// /sys/devices/system/node, or is faked by splitting the allowed CPUs into
+// N nodes (without binding memory) so the partitioning can be exercised on
+// any machine. Placement is set up once, before the books are initialised,
+// and stays in force for the rest of the process.
+const int MAX_NUMA_NODES = 64;
+const size_t NUMA_CHUNK_BYTES = 4 << 20;
 
-            int tradeQty = (newNode->order.quantity < bestOpposite->quantity) ? 
-                           newNode->order.quantity : bestOpposite->quantity;
+struct NumaNode {
+    int osNode; // id under /sys/devices/system/node, or -1 for a fake node
+    cpu_set_t cpus;
+};
 
-            int expectedOpp = bestOpposite->quantity;
-            while (expectedOpp >= tradeQty) {
-                if (__sync_bool_compare_and_swap(&bestOpposite->quantity, expectedOpp, expectedOpp - tradeQty)) {
-                    int expectedNew = newNode->order.quantity;
-                    while (expectedNew >= tradeQty) {
-                        if (__sync_bool_compare_and_swap(&newNode->order.quantity, expectedNew, expectedNew - tradeQty)) {
-                            printf("Trade executed for ticker %s: %d shares at %.2f\n",
-                                   newNode->order.ticker.c_str(), tradeQty, bestOpposite->price);
-                            break;
-                        }
-                        expectedNew = newNode->order.quantity;
-                    }
-                    break;
-                }
-                expectedOpp = bestOpposite->quantity;
+struct NumaChunk {
+    NumaChunk* next;
+    size_t bytes;
+    volatile size_t used;
+};
+
+const size_t NUMA_CHUNK_HEADER = (sizeof(NumaChunk) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+
+struct alignas(CACHE_LINE_SIZE) NumaArena {
+    NumaChunk* volatile chunks;
+};
+
+bool numaEnabled = false;
+int numaNodeCount = 1;
+NumaNode numaNodes[MAX_NUMA_NODES];
+NumaArena numaArenas[MAX_NUMA_NODES];
+thread_local int threadNumaNode = 0;
+
+inline int bookNumaNode(int bookIndex) { return bookIndex % numaNodeCount; }
+
+// Parses a kernel CPU list such as "0-3,8,10-11". Returns the number of CPUs.
+int parseCpuList(const char* text, cpu_set_t& cpus) {
+    CPU_ZERO(&cpus);
+    int count = 0;
+    while (*text) {
+        char* end;
+        long first = strtol(text, &end, 10);
+        if (end == text) {
+            return -1;
+        }
+        long last = first;
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0 && !CPU_ISSET(cpu, &cpus)) {
+                CPU_SET(cpu, &cpus);
+                count++;
             }
         }
+        text = end;
+        while (*text == ',' || *text == '\n' || *text == ' ') {
+            text++;
+        }
     }
-};
+    return count;
+}
 
-Order* OrderBook::findBestOpposite(const Order& order, const OrderList& oppositeOrders) {
-    Order* best = nullptr;
-    double bestPrice = (order.orderType == BUY) ? MAX_DOUBLE : -1.0;
-    OrderNode* node = const_cast<OrderNode*>(oppositeOrders.getHead());
-    while (node) {
-        Order& oppOrder = node->order;
-        int qty = oppOrder.quantity;
-        if (qty > 0) {
-            if (order.orderType == BUY && oppOrder.price <= order.price) {
-                if (oppOrder.price < bestPrice) {
-                    bestPrice = oppOrder.price;
-                    best = &oppOrder;
-                }
-            } else if (order.orderType == SELL && oppOrder.price >= order.price) {
-                if (oppOrder.price > bestPrice) {
-                    bestPrice = oppOrder.price;
-                    best = &oppOrder;
-                }
+bool pinCurrentThread(const cpu_set_t& cpus) {
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) == 0;
+}
+
+// Reads a small sysfs file into buffer; false if it does not exist.
+bool readSysFile(const char* path, char* buffer, size_t size) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    size_t length = fread(buffer, 1, size - 1, file);
+    fclose(file);
+    buffer[length] = '\0';
+    return length > 0;
+}
+
+// fakeNodes > 0 splits the CPUs this process may run on round-robin into
+// that many nodes; otherwise the nodes are read from sysfs, falling back to
+// one fake node when the OS does not expose any.
+void initNuma(int fakeNodes) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    numaNodeCount = 0;
+    if (fakeNodes <= 0) {
+        char path[96];
+        char buffer[4096];
+        for (int node = 0; node < MAX_NUMA_NODES && numaNodeCount < MAX_NUMA_NODES; node++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            NumaNode& entry = numaNodes[numaNodeCount];
+            if (!readSysFile(path, buffer, sizeof(buffer)) || parseCpuList(buffer, entry.cpus) <= 0) {
+                continue;
+            }
+            CPU_AND(&entry.cpus, &entry.cpus, &allowed);
+            if (CPU_COUNT(&entry.cpus) > 0) {
+                entry.osNode = node;
+                numaNodeCount++;
             }
         }
-        node = const_cast<OrderNode*>(node->next);
+        fakeNodes = numaNodeCount == 0 ? 1 : 0;
     }
-    return best;
+    if (fakeNodes > 0) {
+        numaNodeCount = fakeNodes < MAX_NUMA_NODES ? fakeNodes : MAX_NUMA_NODES;
+        for (int node = 0; node < numaNodeCount; node++) {
+            numaNodes[node].osNode = -1;
+            CPU_ZERO(&numaNodes[node].cpus);
+        }
+        int next = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                CPU_SET(cpu, &numaNodes[next++ % numaNodeCount].cpus);
+            }
+        }
+        // More nodes than CPUs: the empty ones share every CPU.
+        for (int node = 0; node < numaNodeCount; node++) {
+            if (CPU_COUNT(&numaNodes[node].cpus) == 0) {
+                numaNodes[node].cpus = allowed;
+            }
+        }
+    }
+    numaEnabled = true;
 }
 
-// Global order books and utility functions
-OrderBook* orderBooks = nullptr;
+// Pins the calling thread to node's CPUs and makes it allocate from node.
+bool enterNumaNode(int node) {
+    threadNumaNode = node;
+    return pinCurrentThread(numaNodes[node].cpus);
+}
 
-void initOrderBooks() {
-    orderBooks = new OrderBook[NUM_TICKERS];
+// Bump allocation from node's arena, cache-line aligned. Memory is only
+// returned by releaseNumaArenas().
+void* numaAllocate(int node, size_t bytes) {
+    bytes = (bytes + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    NumaArena& arena = numaArenas[node];
+    NumaChunk* chunk = arena.chunks;
+    if (chunk) {
+        size_t offset = __sync_fetch_and_add(&chunk->used, bytes);
+        if (offset + bytes <= chunk->bytes) {
+            return reinterpret_cast<char*>(chunk) + offset;
+        }
+    }
+    size_t chunkBytes = NUMA_CHUNK_HEADER + bytes > NUMA_CHUNK_BYTES ? NUMA_CHUNK_HEADER + bytes : NUMA_CHUNK_BYTES;
+    void* mem = mmap(nullptr, chunkBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    if (numaNodes[node].osNode >= 0) {
+        // MPOL_PREFERRED: fall back to other nodes rather than fail when full.
+        const int MPOL_PREFERRED_MODE = 1;
+        unsigned long mask[MAX_NUMA_NODES / 64] = { 0 };
+        mask[numaNodes[node].osNode / 64] = 1UL << (numaNodes[node].osNode % 64);
+        syscall(SYS_mbind, mem, chunkBytes, MPOL_PREFERRED_MODE, mask, (unsigned long)MAX_NUMA_NODES + 1, 0);
+    }
+    NumaChunk* fresh = static_cast<NumaChunk*>(mem);
+    fresh->bytes = chunkBytes;
+    fresh->used = NUMA_CHUNK_HEADER + bytes;
+    NumaChunk* oldHead;
+    do {
+        oldHead = arena.chunks;
+        fresh->next = oldHead;
+    } while (!__sync_bool_compare_and_swap(&arena.chunks, oldHead, fresh));
+    return static_cast<char*>(mem) + NUMA_CHUNK_HEADER;
 }
 
-void cleanupOrderBooks() {
-    delete[] orderBooks;
+// Only safe once nothing allocated from the arenas is in use.
+void releaseNumaArenas() {
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        NumaChunk* chunk = __sync_lock_test_and_set(&numaArenas[node].chunks, (NumaChunk*)nullptr);
+        while (chunk) {
+            NumaChunk* next = chunk->next;
+            munmap(chunk, chunk->bytes);
+            chunk = next;
+        }
+    }
 }
 
-int getOrderBookIndex(const TickerString& ticker) {
-    unsigned int hash = 0;
-    for (int i = 0; ticker[i] != '\0'; i++) {
-        hash = hash * 31 + static_cast<unsigned char>(ticker[i]);
+// Pages the kernel placed on the requesting node and elsewhere, summed over
+// the topology's nodes. False for fake topologies.
+bool readNumaCounters(unsigned long& local, unsigned long& remote) {
+    local = remote = 0;
+    char path[96];
+    char buffer[1024];
+    for (int node = 0; node < numaNodeCount; node++) {
+        if (numaNodes[node].osNode < 0) {
+            return false;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/numastat", numaNodes[node].osNode);
+        if (!readSysFile(path, buffer, sizeof(buffer))) {
+            return false;
+        }
+        const char* localField = strstr(buffer, "local_node ");
+        const char* otherField = strstr(buffer, "other_node ");
+        if (!localField || !otherField) {
+            return false;
+        }
+        local += strtoul(localField + 11, nullptr, 10);
+        remote += strtoul(otherField + 11, nullptr, 10);
     }
-    return hash % NUM_TICKERS;
+    return numaNodeCount > 0;
 }
 
-void addOrder(OrderType orderType, const TickerString& ticker, int quantity, double price) {
-    int idx = getOrderBookIndex(ticker);
-    Order order(orderType, ticker, quantity, price);
-    orderBooks[idx].addOrder(order);
+// Engine threads
+//
+// Matching shards and pool workers are the engine threads: they run the
+// books, so being descheduled shows up directly in tail latency. With an
+// engine CPU list, engine thread slot k is pinned to the k-th CPU of the list
+// (wrapping around), overriding any NUMA node pinning while keeping the
+// thread's node for allocation. Shards take slots 0..shards-1 and pool
+// workers follow. An isolated-core list reserves cores for the engine: it is
+// the default engine list, and the thread that configures pinning moves
+// itself, and with it every thread it starts later, off those cores. The
+// idle strategy decides what an engine thread with no input does: back off
+// to the scheduler after a short spin, or busy-poll with a pause hint and
+// never give up its core.
+enum IdleStrategy { IDLE_BACKOFF, IDLE_BUSY_POLL };
+
+IdleStrategy engineIdle = IDLE_BACKOFF;
+int engineCpus[CPU_SETSIZE];
+int engineCpuCount = 0;
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
 }
 
-TickerString generateTickerSymbol(int index) {
-    char buffer[MAX_TICKER_LENGTH];
-    snprintf(buffer, MAX_TICKER_LENGTH, "TICKER%d", index);
-    return TickerString(buffer);
+inline void engineIdleWait(int& idleSpins) {
+    if (engineIdle == IDLE_BUSY_POLL) {
+        cpuRelax();
+    } else if (++idleSpins > 64) {
+        std::this_thread::yield();
+    }
 }
 
-TickerString* tickers = nullptr;
+// Returns false, naming the first offender, if cpus holds a CPU the process
+// may not run on.
+bool cpusAllowed(const cpu_set_t& cpus, const cpu_set_t& allowed) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus) && !CPU_ISSET(cpu, &allowed)) {
+            fprintf(stderr, "CPU %d is not in this process's affinity mask\n", cpu);
+            return false;
+        }
+    }
+    return true;
+}
 
-void initTickers() {
-    tickers = new TickerString[NUM_TICKERS];
-    for (int i = 0; i < NUM_TICKERS; i++) {
-        tickers[i] = generateTickerSymbol(i);
+// Lists are kernel CPU lists ("0-3,8") and may be null. Returns false when a
+// list does not parse, names a CPU outside the process's affinity mask, or
+// leaves no CPU for the other threads.
+bool configureEngineThreads(const char* cpuList, const char* isolatedList, IdleStrategy idle) {
+    cpu_set_t cpus;
+    cpu_set_t isolated;
+    cpu_set_t allowed;
+    CPU_ZERO(&isolated);
+    if ((cpuList && parseCpuList(cpuList, cpus) <= 0) || (isolatedList && parseCpuList(isolatedList, isolated) <= 0)) {
+        return false;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return false;
+    }
+    if ((cpuList && !cpusAllowed(cpus, allowed)) || (isolatedList && !cpusAllowed(isolated, allowed))) {
+        return false;
+    }
+    if (!cpuList && isolatedList) {
+        cpus = isolated;
+    }
+    engineCpuCount = 0;
+    if (cpuList || isolatedList) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                engineCpus[engineCpuCount++] = cpu;
+            }
+        }
+    }
+    if (isolatedList) {
+        cpu_set_t housekeeping = allowed;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &isolated)) {
+                CPU_CLR(cpu, &housekeeping);
+            }
+        }
+        if (CPU_COUNT(&housekeeping) == 0 || !pinCurrentThread(housekeeping)) {
+            return false;
+        }
     }
+    engineIdle = idle;
+    return true;
 }
 
-void cleanupTickers() {
-    delete[] tickers;
+// Pins the calling engine thread to its CPU, if an engine list is set. A
+// failure is reported on stderr and the thread runs unpinned.
+bool pinEngineThread(int slot) {
+    if (engineCpuCount == 0) {
+        return true;
+    }
+    int cpu = engineCpus[slot % engineCpuCount];
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (!pinCurrentThread(cpus)) {
+        fprintf(stderr, "Cannot pin engine thread %d to CPU %d\n", slot, cpu);
+        return false;
+    }
+    return true;
 }
 
-// Simulation functions
-void simulateTransactions(int numTransactions = 10) {
-    for (int i = 0; i < numTransactions; i++) {
-        OrderType orderType = (rng.randInt(0, 1) == 0) ? BUY : SELL;
-        int tickerIndex = rng.randInt(0, NUM_TICKERS - 1);
-        TickerString ticker = tickers[tickerIndex];
-        int quantity = rng.randInt(1, 100);
-        double price = rng.uniform(10.0, 100.0);
-        price = (int)(price * 100) / 100.0; // Round to 2 decimal places
-        addOrder(orderType, ticker, quantity, price);
+// Stage timing
+//
+// With stage timing on, the order path reads the time stamp counter around
+// its main stages and records the cycles into per-thread histograms (see
+// "Stage histograms" below): creating the order in addOrder, routing its
+// ticker to a book on entry, appending it to its level, every iteration
+// of the match loop, and publishing each fill. Off, each stage costs one
+// predictable branch on stageTiming.
+enum LatencyStage { STAGE_CREATE, STAGE_ROUTE, STAGE_APPEND, STAGE_MATCH, STAGE_FILL, STAGE_COUNT };
+
+bool stageTiming = false;
+
+inline uint64_t readTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return nowNanos();
+#endif
+}
+
+void recordStage(LatencyStage stage, uint64_t cycles);
+
+// Times from construction to stop() or the end of the scope, whichever
+// comes first.
+class StageTimer {
+private:
+    LatencyStage stage;
+    uint64_t start;
+
+public:
+    explicit StageTimer(LatencyStage timed) : stage(timed), start(stageTiming ? readTsc() : 0) {}
+    ~StageTimer() { stop(); }
+
+    void stop() {
+        if (start) {
+            recordStage(stage, readTsc() - start);
+            start = 0;
+        }
+    }
+};
+
+// OrderNode and OrderList classes
+struct PriceLevel;
+
+// One node per cache line: an order never straddles two lines and fills on
+// neighbouring nodes never share one.
+struct alignas(CACHE_LINE_SIZE) OrderNode {
+    Order order;
+    OrderNode* volatile next;
+    PriceLevel* level;
+    OrderNode(const Order& ord) : order(ord), next(nullptr), level(nullptr) {}
+};
+
+// OrderNode pool
+//
+// Nodes are carved from cache-line aligned slabs. Each thread allocates from
+// and releases into its own cache, so the order-entry path never calls
+// malloc. A cache that grows past two slabs' worth of free nodes hands a
+// batch to the shared depot, where threads that run dry pick it up. Slabs are
+// only returned to the system all at once by releaseNodeSlabs(). With NUMA
+// placement every node has its own depot and its slabs come from the node's
+// arena. An order's node is taken from the NUMA node of its book, whichever
+// thread enters it, so each thread keeps one cache per NUMA node and a node
+// goes back to the cache of its book's node when it is released.
+const size_t NODES_PER_SLAB = 4096;
+
+struct FreeNode {
+    FreeNode* next;
+    FreeNode* nextBatch;
+    size_t batchCount;
+};
+
+struct NodeSlab {
+    NodeSlab* next;
+};
+
+const size_t NODE_SLAB_HEADER = CACHE_LINE_SIZE;
+const size_t NODE_SLAB_BYTES = NODE_SLAB_HEADER + NODES_PER_SLAB * sizeof(OrderNode);
+
+struct alignas(CACHE_LINE_SIZE) NodeDepot {
+    FreeNode* volatile head;
+};
+
+NodeSlab* volatile nodeSlabs = nullptr;
+NodeDepot nodeDepots[MAX_NUMA_NODES];
+volatile unsigned long nodePoolGeneration = 0;
+
+char* allocateNodeSlab(int node) {
+    if (numaEnabled) {
+        return static_cast<char*>(numaAllocate(node, NODE_SLAB_BYTES)) + NODE_SLAB_HEADER;
+    }
+    void* mem = nullptr;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, NODE_SLAB_BYTES) != 0) {
+        throw std::bad_alloc();
     }
+    NodeSlab* slab = static_cast<NodeSlab*>(mem);
+    NodeSlab* oldHead;
+    do {
+        oldHead = nodeSlabs;
+        slab->next = oldHead;
+    } while (!__sync_bool_compare_and_swap(&nodeSlabs, oldHead, slab));
+    return static_cast<char*>(mem) + NODE_SLAB_HEADER;
+}
+
+void pushNodeBatch(int node, FreeNode* batch) {
+    FreeNode* volatile& depot = nodeDepots[node].head;
+    FreeNode* oldHead;
+    do {
+        oldHead = depot;
+        batch->nextBatch = oldHead;
+    } while (!__sync_bool_compare_and_swap(&depot, oldHead, batch));
 }
 
-void brokerFunction(int brokerId, int iterations) {
-    for (int i = 0; i < iterations; i++) {
-        simulateTransactions(5);
+// Takes the whole depot and puts back all but one batch, which sidesteps ABA
+// on the shared stack.
+FreeNode* popNodeBatch(int node) {
+    FreeNode* volatile& depot = nodeDepots[node].head;
+    if (!depot) {
+        return nullptr;
     }
-    printf("Broker %d completed activities\n", brokerId);
+    FreeNode* batch = __sync_lock_test_and_set(&depot, (FreeNode*)nullptr);
+    if (!batch) {
+        return nullptr;
+    }
+    FreeNode* rest = batch->nextBatch;
+    while (rest) {
+        FreeNode* next = rest->nextBatch;
+        pushNodeBatch(node, rest);
+        rest = next;
+    }
+    return batch;
 }
 
-void runSimulation() {
-    printf("Starting stock exchange simulation with threads...\n");
-    initOrderBooks();
-    initTickers();
+struct NodeCache {
+    FreeNode* freeList;
+    size_t freeCount;
+    char* bumpCursor;
+    char* bumpEnd;
+};
+
+class OrderNodePool {
+private:
+    NodeCache caches[MAX_NUMA_NODES]; // indexed by NUMA node
+    unsigned long generation;
 
-    const int numBrokers = 5;
-    std::thread brokerThreads[numBrokers];
-    for (int i = 0; i < numBrokers; i++) {
-        brokerThreads[i] = std::thread(brokerFunction, i, 200);
+    void resetIfStale() {
+        if (generation != nodePoolGeneration) {
+            memset(caches, 0, sizeof(caches));
+            generation = nodePoolGeneration;
+        }
     }
 
-    for (int i = 0; i < numBrokers; i++) {
-        brokerThreads[i].join();
+public:
+    OrderNodePool() : generation(0) { memset(caches, 0, sizeof(caches)); }
+
+    ~OrderNodePool() {
+        if (generation != nodePoolGeneration) {
+            return;
+        }
+        for (int numaNode = 0; numaNode < MAX_NUMA_NODES; numaNode++) {
+            if (caches[numaNode].freeList) {
+                caches[numaNode].freeList->batchCount = caches[numaNode].freeCount;
+                pushNodeBatch(numaNode, caches[numaNode].freeList);
+            }
+        }
     }
 
-    printf("Simulation completed\n");
-    cleanupTickers();
-    cleanupOrderBooks();
+    void* allocate(int numaNode) {
+        resetIfStale();
+        NodeCache& cache = caches[numaNode];
+        if (!cache.freeList && cache.bumpCursor == cache.bumpEnd) {
+            FreeNode* batch = popNodeBatch(numaNode);
+            if (batch) {
+                cache.freeList = batch;
+                cache.freeCount = batch->batchCount;
+            } else {
+                cache.bumpCursor = allocateNodeSlab(numaNode);
+                cache.bumpEnd = cache.bumpCursor + NODES_PER_SLAB * sizeof(OrderNode);
+            }
+        }
+        if (cache.freeList) {
+            FreeNode* node = cache.freeList;
+            cache.freeList = node->next;
+            cache.freeCount--;
+            return node;
+        }
+        void* node = cache.bumpCursor;
+        cache.bumpCursor += sizeof(OrderNode);
+        return node;
+    }
+
+    void release(void* ptr, int numaNode) {
+        resetIfStale();
+        NodeCache& cache = caches[numaNode];
+        FreeNode* node = static_cast<FreeNode*>(ptr);
+        node->next = cache.freeList;
+        cache.freeList = node;
+        if (++cache.freeCount < 2 * NODES_PER_SLAB) {
+            return;
+        }
+        FreeNode* batch = cache.freeList;
+        FreeNode* last = batch;
+        for (size_t i = 1; i < NODES_PER_SLAB; i++) last = last->next;
+        cache.freeList = last->next;
+        cache.freeCount -= NODES_PER_SLAB;
+        last->next = nullptr;
+        batch->batchCount = NODES_PER_SLAB;
+        pushNodeBatch(numaNode, batch);
+    }
+};
+
+thread_local OrderNodePool nodePool;
+
+int getOrderBookIndex(const TickerString& ticker);
+
+// numaNode is the node of the order's book; list dummies, which belong to no
+// order, use the calling thread's node.
+OrderNode* allocateOrderNode(const Order& order, int numaNode = threadNumaNode) {
+    return new (nodePool.allocate(numaNode)) OrderNode(order);
 }
 
-int main() {
-    runSimulation();
-    return 0;
-}
\ No newline at end of file
+// A node goes back to the cache of the node it came from: its book's, or the
+// thread's for a dummy that was never an order.
+void releaseOrderNode(OrderNode* node) {
+    int numaNode = 0;
+    if (numaEnabled) {
+        int bookIndex = getOrderBookIndex(node->order.ticker);
+        numaNode = bookIndex >= 0 ? bookNumaNode(bookIndex) : threadNumaNode;
+    }
+    nodePool.release(node, numaNode);
+}
+
+void reclaimOrderNode(void* ptr) {
+    releaseOrderNode(static_cast<OrderNode*>(ptr));
+}
+
+// Carves slabs up front into depot batches so that the first orders of a run
+// do not pay for slab allocation. With NUMA placement the slabs are spread
+// over the nodes' depots.
+void preallocateOrderNodes(size_t count) {
+    size_t slabCount = (count + NODES_PER_SLAB - 1) / NODES_PER_SLAB;
+    for (size_t s = 0; s < slabCount; s++) {
+        int numaNode = (int)(s % numaNodeCount);
+        char* nodes = allocateNodeSlab(numaNode);
+        FreeNode* batch = nullptr;
+        for (size_t i = NODES_PER_SLAB; i-- > 0;) {
+            FreeNode* node = reinterpret_cast<FreeNode*>(nodes + i * sizeof(OrderNode));
+            node->next = batch;
+            batch = node;
+        }
+        batch->batchCount = NODES_PER_SLAB;
+        pushNodeBatch(numaNode, batch);
+    }
+}
+
+// Only safe once no thread holds nodes; stale per-thread caches notice the
+// generation change and drop their pointers.
+void releaseNodeSlabs() {
+    __sync_add_and_fetch(&nodePoolGeneration, 1);
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        nodeDepots[node].head = nullptr;
+    }
+    NodeSlab* slab = __sync_lock_test_and_set(&nodeSlabs, (NodeSlab*)nullptr);
+    while (slab) {
+        NodeSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+}
+
+// Order index
+//
+// Open-addressing table from order id to its resting OrderNode, so cancels
+// and amendments find an order in O(1) without walking any queue. The table
+// is split into ORDER_INDEX_SEGMENTS segments by id hash. Lookups are
+// lock-free; inserts and erases take their segment's spin lock, which with
+// 64 segments is almost never contended. Erased entries become tombstones,
+// so a probe stops at the first never-used slot. A segment that would pass
+// three-quarters full (tombstones included) is rebuilt at twice its live
+// count or more, and the old table is retired through the epoch scheme, so
+// the index grows with the book and probe lengths stay short. Entries are
+// erased by whichever thread takes an order's fill state to zero, which
+// always happens before the node can be retired. In sharded mode an order is
+// entered as pending, with only its book, before it is queued to its shard;
+// booking it replaces the entry with its node. That lets cancels and
+// amendments be routed to the right shard while the order is still queued.
+// Orders resting in an array book (see "Structure-of-arrays book") have no
+// node either; their entry keeps the book and is marked array-booked.
+const size_t MIN_ORDER_INDEX_SEGMENT_CAPACITY = 1 << 10;
+const int ORDER_INDEX_SEGMENT_BITS = 6;
+const int ORDER_INDEX_SEGMENTS = 1 << ORDER_INDEX_SEGMENT_BITS;
+const uint64_t ORDER_INDEX_TOMBSTONE = ~(uint64_t)0;
+
+struct OrderIndexSlot {
+    volatile uint64_t key;
+    OrderNode* volatile node; // nullptr while pending or in an array book
+    volatile int book;        // book of an entry without a node
+    volatile int arrayBooked;
+    volatile int arraySlot;   // where an array-booked order sits in its book's arrays
+};
+
+struct OrderIndexTable {
+    OrderIndexSlot* slots;
+    size_t mask;
+    size_t used; // live entries and tombstones
+    size_t live;
+
+    explicit OrderIndexTable(size_t capacity)
+        : slots(static_cast<OrderIndexSlot*>(calloc(capacity, sizeof(OrderIndexSlot)))), mask(capacity - 1), used(0),
+          live(0) {
+        if (!slots) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~OrderIndexTable() { free(slots); }
+};
+
+void reclaimOrderIndexTable(void* ptr) {
+    delete static_cast<OrderIndexTable*>(ptr);
+}
+
+struct alignas(CACHE_LINE_SIZE) OrderIndexSegment {
+    OrderIndexTable* volatile table;
+    volatile int writeLock;
+
+    OrderIndexSegment() : table(nullptr), writeLock(0) {}
+};
+
+class OrderIndex {
+private:
+    OrderIndexSegment* segments;
+
+    static uint64_t hash(uint64_t id) { return id * 0x9E3779B97F4A7C15ULL; }
+    OrderIndexSegment& segmentOf(uint64_t h) const { return segments[h >> (64 - ORDER_INDEX_SEGMENT_BITS)]; }
+
+    void store(uint64_t id, OrderNode* node, int book, int arrayBooked, int arraySlot) {
+        uint64_t h = hash(id);
+        OrderIndexSegment& segment = segmentOf(h);
+        lock(segment);
+        OrderIndexTable* table = segment.table;
+        if ((table->used + 1) * 4 > (table->mask + 1) * 3) {
+            table = rebuild(segment, table);
+        }
+        place(table, id, h, node, book, arrayBooked, arraySlot);
+        unlock(segment);
+    }
+
+    const OrderIndexSlot* lookup(uint64_t id) const {
+        uint64_t h = hash(id);
+        const OrderIndexTable* table = __atomic_load_n(&segmentOf(h).table, __ATOMIC_ACQUIRE);
+        for (size_t probe = 0; probe <= table->mask; probe++) {
+            const OrderIndexSlot& slot = table->slots[(home(h, table->mask) + probe) & table->mask];
+            uint64_t key = __atomic_load_n(&slot.key, __ATOMIC_ACQUIRE);
+            if (key == 0) {
+                return nullptr;
+            }
+            if (key == id) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+    static size_t home(uint64_t h, size_t mask) { return (size_t)(h >> 16) & mask; }
+
+    static void lock(OrderIndexSegment& segment) {
+        while (__sync_lock_test_and_set(&segment.writeLock, 1)) {
+            while (segment.writeLock) {
+                cpuRelax();
+            }
+        }
+    }
+
+    static void unlock(OrderIndexSegment& segment) { __sync_lock_release(&segment.writeLock); }
+
+    // Writer only. The node is stored before the key, so a reader that sees
+    // the key also sees the node.
+    static void place(OrderIndexTable* table, uint64_t id, uint64_t h, OrderNode* node, int book, int arrayBooked,
+                      int arraySlot) {
+        size_t tombstone = (size_t)-1;
+        for (size_t probe = 0; probe <= table->mask; probe++) {
+            size_t index = (home(h, table->mask) + probe) & table->mask;
+            OrderIndexSlot& slot = table->slots[index];
+            if (slot.key == id) {
+                slot.book = book;
+                slot.arrayBooked = arrayBooked;
+                slot.arraySlot = arraySlot;
+                slot.node = node;
+                return;
+            }
+            if (slot.key == ORDER_INDEX_TOMBSTONE) {
+                if (tombstone == (size_t)-1) {
+                    tombstone = index;
+                }
+            } else if (slot.key == 0) {
+                if (tombstone == (size_t)-1) {
+                    tombstone = index;
+                    table->used++;
+                }
+                break;
+            }
+        }
+        OrderIndexSlot& slot = table->slots[tombstone];
+        slot.node = node;
+        slot.book = book;
+        slot.arrayBooked = arrayBooked;
+        slot.arraySlot = arraySlot;
+        __atomic_store_n(&slot.key, id, __ATOMIC_RELEASE);
+        table->live++;
+    }
+
+    // Writer only; must be called inside an EpochGuard.
+    static OrderIndexTable* rebuild(OrderIndexSegment& segment, OrderIndexTable* old) {
+        size_t capacity = MIN_ORDER_INDEX_SEGMENT_CAPACITY;
+        while (capacity < (old->live + 1) * 4) {
+            capacity <<= 1;
+        }
+        OrderIndexTable* table = new OrderIndexTable(capacity);
+        for (size_t i = 0; i <= old->mask; i++) {
+            uint64_t key = old->slots[i].key;
+            if (key != 0 && key != ORDER_INDEX_TOMBSTONE) {
+                const OrderIndexSlot& entry = old->slots[i];
+                place(table, key, hash(key), entry.node, entry.book, entry.arrayBooked, entry.arraySlot);
+            }
+        }
+        __atomic_store_n(&segment.table, table, __ATOMIC_RELEASE);
+        epochThread.retire(old, reclaimOrderIndexTable);
+        return table;
+    }
+
+public:
+    OrderIndex() : segments(nullptr) {}
+    ~OrderIndex() { release(); }
+
+    // Presizes the segments for expectedOrders live orders; they grow past
+    // that on demand. Only call while no thread uses the index.
+    void reset(size_t expectedOrders) {
+        release();
+        size_t capacity = MIN_ORDER_INDEX_SEGMENT_CAPACITY;
+        while (capacity < expectedOrders * 2 / ORDER_INDEX_SEGMENTS) {
+            capacity <<= 1;
+        }
+        segments = newAlignedArray<OrderIndexSegment>(ORDER_INDEX_SEGMENTS);
+        for (int i = 0; i < ORDER_INDEX_SEGMENTS; i++) {
+            segments[i].table = new OrderIndexTable(capacity);
+        }
+    }
+
+    void release() {
+        if (!segments) {
+            return;
+        }
+        for (int i = 0; i < ORDER_INDEX_SEGMENTS; i++) {
+            delete segments[i].table;
+        }
+        deleteAlignedArray(segments, ORDER_INDEX_SEGMENTS);
+        segments = nullptr;
+    }
+
+    // Must be called inside an EpochGuard. Never drops an entry: a full
+    // segment is rebuilt larger first. Replaces a pending entry for the id.
+    void insert(OrderNode* node) { store(node->order.orderId, node, -1, 0, 0); }
+
+    // Enters a queued order by its book; must be called inside an EpochGuard.
+    void insertPending(uint64_t id, int bookIndex) { store(id, nullptr, bookIndex, 0, 0); }
+
+    // Enters an order resting in an array book at arraySlot, replacing its
+    // pending entry or, when the book's arrays were compacted, its old slot;
+    // must be called inside an EpochGuard.
+    void insertArrayBooked(uint64_t id, int bookIndex, int arraySlot) { store(id, nullptr, bookIndex, 1, arraySlot); }
+
+    // Must be called inside an EpochGuard; the node stays valid until the
+    // guard is left. Pending orders are not found.
+    OrderNode* find(uint64_t id) const {
+        const OrderIndexSlot* slot = lookup(id);
+        if (!slot) {
+            return nullptr;
+        }
+        OrderNode* node = slot->node;
+        return (node && node->order.orderId == id) ? node : nullptr;
+    }
+
+    // Book of a pending order, or -1 when the id is booked or unknown.
+    int findPending(uint64_t id) const {
+        const OrderIndexSlot* slot = lookup(id);
+        return (slot && !slot->node && !slot->arrayBooked) ? slot->book : -1;
+    }
+
+    // Array slot of an order resting in an array book, or -1. Only the book's
+    // writer may rely on it: compaction moves the slots.
+    int findArraySlot(uint64_t id) const {
+        const OrderIndexSlot* slot = lookup(id);
+        return (slot && slot->arrayBooked) ? slot->arraySlot : -1;
+    }
+
+    // Book of an order without a node, pending or resting in an array book,
+    // or -1.
+    int findNodelessBook(uint64_t id) const {
+        const OrderIndexSlot* slot = lookup(id);
+        return (slot && !slot->node) ? slot->book : -1;
+    }
+
+    void erase(OrderNode* node) { erase(node->order.orderId); }
+
+    void erase(uint64_t id) {
+        uint64_t h = hash(id);
+        OrderIndexSegment& segment = segmentOf(h);
+        lock(segment);
+        OrderIndexTable* table = segment.table;
+        for (size_t probe = 0; probe <= table->mask; probe++) {
+            OrderIndexSlot& slot = table->slots[(home(h, table->mask) + probe) & table->mask];
+            if (slot.key == 0) {
+                break;
+            }
+            if (slot.key == id) {
+                slot.node = nullptr;
+                __atomic_store_n(&slot.key, ORDER_INDEX_TOMBSTONE, __ATOMIC_RELEASE);
+                table->live--;
+                break;
+            }
+        }
+        unlock(segment);
+    }
+
+    // Live entries; exact only while no thread writes.
+    size_t size() const {
+        size_t live = 0;
+        for (int i = 0; i < ORDER_INDEX_SEGMENTS; i++) {
+            live += segments[i].table->live;
+        }
+        return live;
+    }
+};
+
+OrderIndex orderIndex;
+
+// Lock-free FIFO of the orders resting at one price (Michael-Scott queue).
+// New orders are enqueued at the tail and matching always takes the order at
+// the head, so orders at the same price fill oldest first. Orders that reach
+// zero (filled, or consumed while still behind older orders) stay in place
+// until they reach the head, where front() dequeues them in O(1). head always
+// points at a dummy node; a dequeued node becomes the new dummy and the old
+// dummy is retired through the epoch scheme.
+class OrderList {
+private:
+    OrderNode* volatile head;
+    OrderNode* volatile tail;
+
+public:
+    OrderList() {
+        OrderNode* dummy = allocateOrderNode(Order(BUY, TickerString(), 0, 0, 0));
+        head = tail = dummy;
+    }
+
+    ~OrderList() {
+        OrderNode* node = head;
+        while (node) {
+            OrderNode* next = node->next;
+            releaseOrderNode(node);
+            node = next;
+        }
+    }
+
+    // numaNode is the NUMA node of the list's book, which the node is taken
+    // from.
+    OrderNode* append(const Order& order, PriceLevel* level, int numaNode) {
+        OrderNode* newNode = allocateOrderNode(order, numaNode);
+        newNode->level = level;
+        orderIndex.insert(newNode);
+        while (true) {
+            OrderNode* last = tail;
+            OrderNode* next = last->next;
+            if (last != tail) {
+                continue;
+            }
+            if (next) {
+                __sync_bool_compare_and_swap(&tail, last, next);
+                continue;
+            }
+            // The node is not yet visible, so its position can be stamped
+            // from the tail it is about to follow.
+            newNode->order.queuePosition = last->order.queuePosition + 1;
+            if (__sync_bool_compare_and_swap(&last->next, (OrderNode*)nullptr, newNode)) {
+                __sync_bool_compare_and_swap(&tail, last, newNode);
+                return newNode;
+            }
+        }
+    }
+
+    // Oldest order with quantity available, or nullptr. Dead orders (nothing
+    // available or reserved) at the head are dequeued on the way.
+    OrderNode* front() {
+        while (true) {
+            OrderNode* first = head;
+            OrderNode* last = tail;
+            OrderNode* next = first->next;
+            if (first != head) {
+                continue;
+            }
+            if (!next) {
+                return nullptr;
+            }
+            if (first == last) {
+                __sync_bool_compare_and_swap(&tail, last, next);
+                continue;
+            }
+            uint64_t state = next->order.fillState;
+            if (availableOf(state) > 0) {
+                return next;
+            }
+            if (!fillsDone(state)) {
+                // Fully reserved by a fill in flight: it may not be dequeued
+                // yet, but there is nothing left to match against it either.
+                return firstAvailableAfter(next);
+            }
+            if (__sync_bool_compare_and_swap(&head, first, next)) {
+                epochThread.retire(first, reclaimOrderNode);
+            }
+        }
+    }
+
+    // Visits every order with shares available, in queue order. Only
+    // consistent while no thread is matching on the list.
+    template <typename Visitor>
+    void forEach(Visitor& visit) const {
+        for (OrderNode* node = head->next; node; node = node->next) {
+            if (node->order.availableQuantity() > 0) {
+                visit(node->order);
+            }
+        }
+    }
+
+private:
+    static OrderNode* firstAvailableAfter(OrderNode* node) {
+        for (node = node->next; node; node = node->next) {
+            if (node->order.availableQuantity() > 0) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Marked pointers: the low bit of a next pointer flags its owner as deleted.
+inline bool isMarked(uintptr_t ref) { return (ref & 1) != 0; }
+inline uintptr_t markRef(uintptr_t ref) { return ref | 1; }
+inline uintptr_t unmarkRef(uintptr_t ref) { return ref & ~(uintptr_t)1; }
+
+// PriceLevel and PriceLevelList classes
+//
+// Each side of a book is a lock-free skip list of price levels sorted from
+// best to worst, so the best level is always the first live successor of the
+// head. Levels carry the open quantity resting at their price; a level whose
+// open quantity drops to zero is closed (LEVEL_CLOSED) and unlinked, after
+// which no order can be added to it. Next pointers use the low bit as the
+// deletion mark (Herlihy-Shavit / Fraser style). An unlinked level is retired
+// only after both its remover and its inserter are done with it, because the
+// inserter may still be linking upper heights when the level is removed.
+const int MAX_SKIP_HEIGHT = 16;
+const int64_t LEVEL_CLOSED = -1;
+
+inline PriceLevel* levelRef(uintptr_t ref) { return reinterpret_cast<PriceLevel*>(unmarkRef(ref)); }
+
+struct PriceLevel {
+    int priceTicks;
+    int sortKey;
+    volatile int64_t openQuantity; // 64-bit: many orders near INT_MAX can share a price
+    OrderList orders;
+    int height;
+    volatile int retireVotes;
+    volatile uintptr_t next[MAX_SKIP_HEIGHT];
+
+    PriceLevel(int ticks, int key, int qty, int h)
+        : priceTicks(ticks), sortKey(key), openQuantity(qty), height(h), retireVotes(0) {
+        for (int i = 0; i < MAX_SKIP_HEIGHT; i++) next[i] = 0;
+    }
+};
+
+void reclaimPriceLevel(void* ptr) {
+    delete static_cast<PriceLevel*>(ptr);
+}
+
+void voteRetireLevel(PriceLevel* level) {
+    if (__sync_add_and_fetch(&level->retireVotes, 1) == 2) {
+        epochThread.retire(level, reclaimPriceLevel);
+    }
+}
+
+class alignas(CACHE_LINE_SIZE) PriceLevelList {
+private:
+    PriceLevel head;
+    bool descending;
+
+    int sortKeyFor(int priceTicks) const { return descending ? -priceTicks : priceTicks; }
+    bool find(int key, PriceLevel** preds, PriceLevel** succs);
+    void linkUpperHeights(PriceLevel* newLevel, PriceLevel** preds, PriceLevel** succs);
+    static int randomHeight();
+
+public:
+    explicit PriceLevelList(bool desc) : head(0, 0, 0, MAX_SKIP_HEIGHT), descending(desc) {}
+    ~PriceLevelList();
+
+    PriceLevel* acquireLevel(int priceTicks, int quantity);
+    void releaseQuantity(PriceLevel* level, int quantity);
+    void removeLevel(PriceLevel* level);
+    PriceLevel* first();
+    PriceLevel* nextLevel(PriceLevel* level);
+};
+
+int PriceLevelList::randomHeight() {
+    static thread_local unsigned int seed = 0;
+    if (seed == 0) {
+        seed = (unsigned int)(uintptr_t)&seed | 1;
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int height = 1 + __builtin_ctz(seed | (1u << (MAX_SKIP_HEIGHT - 1)));
+    return height;
+}
+
+// Locates the window for key at every height, unlinking marked levels on the
+// way. Returns true when a level with exactly this key is present.
+bool PriceLevelList::find(int key, PriceLevel** preds, PriceLevel** succs) {
+retry:
+    PriceLevel* pred = &head;
+    for (int h = MAX_SKIP_HEIGHT - 1; h >= 0; h--) {
+        PriceLevel* curr = levelRef(pred->next[h]);
+        while (curr) {
+            uintptr_t succ = curr->next[h];
+            while (isMarked(succ)) {
+                if (!__sync_bool_compare_and_swap(&pred->next[h], (uintptr_t)curr, succ & ~(uintptr_t)1)) {
+                    goto retry;
+                }
+                curr = levelRef(succ);
+                if (!curr) break;
+                succ = curr->next[h];
+            }
+            if (curr && curr->sortKey < key) {
+                pred = curr;
+                curr = levelRef(succ);
+            } else {
+                break;
+            }
+        }
+        preds[h] = pred;
+        succs[h] = curr;
+    }
+    return succs[0] && succs[0]->sortKey == key;
+}
+
+// Returns the level for price with quantity already added to its open
+// quantity, inserting a new level when none is live at that price.
+PriceLevel* PriceLevelList::acquireLevel(int priceTicks, int quantity) {
+    int key = sortKeyFor(priceTicks);
+    PriceLevel* preds[MAX_SKIP_HEIGHT];
+    PriceLevel* succs[MAX_SKIP_HEIGHT];
+    while (true) {
+        if (find(key, preds, succs)) {
+            PriceLevel* level = succs[0];
+            int64_t expected = level->openQuantity;
+            while (expected != LEVEL_CLOSED) {
+                if (__sync_bool_compare_and_swap(&level->openQuantity, expected, expected + quantity)) {
+                    return level;
+                }
+                expected = level->openQuantity;
+            }
+            removeLevel(level);
+            continue;
+        }
+
+        int height = randomHeight();
+        PriceLevel* newLevel = new PriceLevel(priceTicks, key, quantity, height);
+        for (int h = 0; h < height; h++) {
+            newLevel->next[h] = (uintptr_t)succs[h];
+        }
+        if (!__sync_bool_compare_and_swap(&preds[0]->next[0], (uintptr_t)succs[0], (uintptr_t)newLevel)) {
+            delete newLevel;
+            continue;
+        }
+        linkUpperHeights(newLevel, preds, succs);
+        voteRetireLevel(newLevel);
+        return newLevel;
+    }
+}
+
+// Links heights above the bottom one, giving up as soon as a concurrent
+// remover has marked the level.
+void PriceLevelList::linkUpperHeights(PriceLevel* newLevel, PriceLevel** preds, PriceLevel** succs) {
+    for (int h = 1; h < newLevel->height; h++) {
+        while (true) {
+            uintptr_t succ = newLevel->next[h];
+            if (isMarked(succ)) {
+                return;
+            }
+            if (levelRef(succ) != succs[h] &&
+                !__sync_bool_compare_and_swap(&newLevel->next[h], succ, (uintptr_t)succs[h])) {
+                continue;
+            }
+            if (__sync_bool_compare_and_swap(&preds[h]->next[h], (uintptr_t)succs[h], (uintptr_t)newLevel)) {
+                if (isMarked(newLevel->next[h])) {
+                    find(newLevel->sortKey, preds, succs);
+                    return;
+                }
+                break;
+            }
+            find(newLevel->sortKey, preds, succs);
+            if (succs[0] != newLevel) {
+                return;
+            }
+        }
+    }
+}
+
+void PriceLevelList::releaseQuantity(PriceLevel* level, int quantity) {
+    if (__sync_sub_and_fetch(&level->openQuantity, (int64_t)quantity) == 0 &&
+        __sync_bool_compare_and_swap(&level->openQuantity, (int64_t)0, LEVEL_CLOSED)) {
+        removeLevel(level);
+    }
+}
+
+// Marks every height of a closed level top-down and then lets find() unlink
+// it. Safe to call from several threads; the bottom mark decides the winner.
+void PriceLevelList::removeLevel(PriceLevel* level) {
+    for (int h = level->height - 1; h >= 1; h--) {
+        uintptr_t succ = level->next[h];
+        while (!isMarked(succ)) {
+            __sync_bool_compare_and_swap(&level->next[h], succ, markRef(succ));
+            succ = level->next[h];
+        }
+    }
+    bool won = false;
+    uintptr_t succ = level->next[0];
+    while (!isMarked(succ)) {
+        if (__sync_bool_compare_and_swap(&level->next[0], succ, markRef(succ))) {
+            won = true;
+            break;
+        }
+        succ = level->next[0];
+    }
+    PriceLevel* preds[MAX_SKIP_HEIGHT];
+    PriceLevel* succs[MAX_SKIP_HEIGHT];
+    find(level->sortKey, preds, succs);
+    if (won) {
+        voteRetireLevel(level);
+    }
+}
+
+// Only called once the book is quiescent. Marked levels belong to the retire
+// bags and are skipped here.
+PriceLevelList::~PriceLevelList() {
+    PriceLevel* curr = levelRef(head.next[0]);
+    while (curr) {
+        uintptr_t succ = curr->next[0];
+        if (!isMarked(succ)) {
+            delete curr;
+        }
+        curr = levelRef(succ);
+    }
+}
+
+// Best live level on this side, closing and unlinking drained levels found at
+// the front. Amortized O(1).
+PriceLevel* PriceLevelList::first() {
+    return nextLevel(&head);
+}
+
+PriceLevel* PriceLevelList::nextLevel(PriceLevel* level) {
+    PriceLevel* curr = levelRef(level->next[0]);
+    while (curr) {
+        int64_t open = curr->openQuantity;
+        if (open > 0 && !isMarked(curr->next[0])) {
+            return curr;
+        }
+        if (open == 0) {
+            __sync_bool_compare_and_swap(&curr->openQuantity, (int64_t)0, LEVEL_CLOSED);
+        }
+        if (curr->openQuantity == LEVEL_CLOSED) {
+            removeLevel(curr);
+        }
+        curr = levelRef(curr->next[0]);
+    }
+    return nullptr;
+}
+
+// Lock-free rings
+// Bounded lock-free ring with many producers and one consumer (Vyukov). Each
+// cell carries a sequence number that tells producers and the consumer whose
+// turn it is, so the only shared CAS is on enqueuePos.
+template <typename T>
+class MpscRing {
+private:
+    struct alignas(CACHE_LINE_SIZE) Cell {
+        volatile size_t sequence;
+        T value;
+    };
+
+    Cell* cells;
+    size_t mask;
+    alignas(CACHE_LINE_SIZE) volatile size_t enqueuePos;
+    alignas(CACHE_LINE_SIZE) size_t dequeuePos;
+
+public:
+    explicit MpscRing(size_t capacity)
+        : cells(newAlignedArray<Cell>(capacity)), mask(capacity - 1), enqueuePos(0), dequeuePos(0) {
+        for (size_t i = 0; i < capacity; i++) cells[i].sequence = i;
+    }
+
+    ~MpscRing() { deleteAlignedArray(cells, mask + 1); }
+
+    bool tryPush(const T& value) {
+        size_t pos = enqueuePos;
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = __atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos + 1)) {
+                    cell.value = value;
+                    __atomic_store_n(&cell.sequence, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+                pos = enqueuePos;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos;
+            }
+        }
+    }
+
+    // Claims up to count consecutive cells with one CAS and returns how many
+    // values were pushed. The consumer frees cells in order, so the run is
+    // free once its last cell is.
+    size_t tryPushBatch(const T* values, size_t count) {
+        size_t pos = enqueuePos;
+        while (true) {
+            size_t run = count;
+            while (run > 0 && __atomic_load_n(&cells[(pos + run - 1) & mask].sequence, __ATOMIC_ACQUIRE) != pos + run - 1) {
+                run--;
+            }
+            if (run == 0) {
+                if ((intptr_t)__atomic_load_n(&cells[pos & mask].sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos < 0) {
+                    return 0;
+                }
+            } else if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos + run)) {
+                for (size_t i = 0; i < run; i++) {
+                    Cell& cell = cells[(pos + i) & mask];
+                    cell.value = values[i];
+                    __atomic_store_n(&cell.sequence, pos + i + 1, __ATOMIC_RELEASE);
+                }
+                return run;
+            }
+            pos = enqueuePos;
+        }
+    }
+
+    bool tryPop(T& value) {
+        Cell& cell = cells[dequeuePos & mask];
+        if (__atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE) != dequeuePos + 1) {
+            return false;
+        }
+        value = cell.value;
+        __atomic_store_n(&cell.sequence, dequeuePos + mask + 1, __ATOMIC_RELEASE);
+        dequeuePos++;
+        return true;
+    }
+};
+
+// Bounded single-producer single-consumer ring (Lamport). Each side caches
+// the other side's index so that it only reads the shared line when the ring
+// looks full or empty.
+template <typename T>
+class SpscRing {
+private:
+    T* items;
+    size_t mask;
+    alignas(CACHE_LINE_SIZE) volatile size_t head;
+    size_t cachedTail;
+    alignas(CACHE_LINE_SIZE) volatile size_t tail;
+    size_t cachedHead;
+
+public:
+    explicit SpscRing(size_t capacity)
+        : items(new T[capacity]), mask(capacity - 1), head(0), cachedTail(0), tail(0), cachedHead(0) {}
+
+    ~SpscRing() { delete[] items; }
+
+    bool tryPush(const T& value) {
+        size_t pos = tail;
+        if (pos - cachedHead > mask) {
+            cachedHead = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+            if (pos - cachedHead > mask) {
+                return false;
+            }
+        }
+        items[pos & mask] = value;
+        __atomic_store_n(&tail, pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        size_t pos = head;
+        if (pos == cachedTail) {
+            cachedTail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+            if (pos == cachedTail) {
+                return false;
+            }
+        }
+        value = items[pos & mask];
+        __atomic_store_n(&head, pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+// Event channels
+//
+// Events leave the matching threads as fixed-size records through a ring
+// owned by the publishing thread and are drained by one writer thread, so
+// publishing never takes a lock or formats text inside the matching loop. A
+// thread registers its channel on first use; opening the channels again
+// bumps the generation, which tells threads that their old channel is gone.
+// There is one EventChannels instance per record type.
+template <typename T, size_t CAPACITY>
+struct alignas(CACHE_LINE_SIZE) EventChannel {
+    SpscRing<T> ring;
+    volatile unsigned long dropped;
+    EventChannel* next;
+
+    EventChannel() : ring(CAPACITY), dropped(0), next(nullptr) {}
+};
+
+template <typename T, size_t CAPACITY>
+class EventChannels {
+public:
+    typedef EventChannel<T, CAPACITY> Channel;
+
+    volatile bool active;
+
+    EventChannels() : active(false), channels(nullptr), generation(0) {}
+
+    void open() {
+        __sync_add_and_fetch(&generation, 1);
+        __atomic_store_n(&active, true, __ATOMIC_RELEASE);
+    }
+
+    void close() { __atomic_store_n(&active, false, __ATOMIC_RELEASE); }
+
+    bool isOpen() const { return __atomic_load_n(&active, __ATOMIC_ACQUIRE); }
+
+    // Drops and counts the record when the ring is full.
+    void tryPublish(const T& record) {
+        Channel* channel = local();
+        if (!channel->ring.tryPush(record)) {
+            channel->dropped++;
+        }
+    }
+
+    // Waits for the writer when the ring is full, for streams that must not
+    // lose records.
+    void publish(const T& record) {
+        Channel* channel = local();
+        while (!channel->ring.tryPush(record)) {
+            std::this_thread::yield();
+        }
+    }
+
+    template <typename Handler>
+    int drain(Handler handler) {
+        int drained = 0;
+        T record;
+        for (Channel* channel = channels; channel; channel = channel->next) {
+            while (channel->ring.tryPop(record)) {
+                handler(record);
+                drained++;
+            }
+        }
+        return drained;
+    }
+
+    // Frees every channel and returns how many records were dropped. Only
+    // call once publishers and the writer have stopped.
+    unsigned long release() {
+        unsigned long dropped = 0;
+        Channel* channel = __sync_lock_test_and_set(&channels, (Channel*)nullptr);
+        while (channel) {
+            Channel* next = channel->next;
+            dropped += channel->dropped;
+            deleteAlignedArray(channel, 1);
+            channel = next;
+        }
+        return dropped;
+    }
+
+private:
+    Channel* volatile channels;
+    volatile unsigned long generation;
+    static thread_local Channel* localChannel;
+    static thread_local unsigned long localGeneration;
+
+    Channel* local() {
+        Channel* channel = localChannel;
+        if (channel && localGeneration == generation) {
+            return channel;
+        }
+        channel = newAlignedArray<Channel>(1);
+        Channel* oldHead;
+        do {
+            oldHead = channels;
+            channel->next = oldHead;
+        } while (!__sync_bool_compare_and_swap(&channels, oldHead, channel));
+        localChannel = channel;
+        localGeneration = generation;
+        return channel;
+    }
+};
+
+template <typename T, size_t CAPACITY>
+thread_local EventChannel<T, CAPACITY>* EventChannels<T, CAPACITY>::localChannel = nullptr;
+template <typename T, size_t CAPACITY>
+thread_local unsigned long EventChannels<T, CAPACITY>::localGeneration = 0;
+
+// Trade events
+//
+// Every fill is published as a TradeRecord. A full ring drops the record and
+// counts it rather than stalling the matcher.
+const size_t TRADE_RING_CAPACITY = 1 << 16;
+
+struct TradeRecord {
+    TickerString ticker;
+    int bookIndex;
+    int quantity;
+    int priceTicks;
+    uint64_t incomingOrderId;
+    uint64_t restingOrderId;
+    OrderType incomingType;
+};
+
+EventChannels<TradeRecord, TRADE_RING_CAPACITY> tradeChannels;
+
+inline void publishTrade(const TradeRecord& record) {
+    if (tradeChannels.active) {
+        tradeChannels.tryPublish(record);
+    }
+}
+
+// Level deltas
+//
+// Every change to a price level's aggregate quantity is published as a delta
+// for the market-data writer. Deltas commute, so the writer can apply them in
+// whatever order the per-thread rings deliver them; a full ring makes the
+// matcher wait rather than lose one.
+const size_t LEVEL_DELTA_RING_CAPACITY = 1 << 16;
+
+struct LevelDelta {
+    int bookIndex;
+    int priceTicks;
+    int delta;
+    OrderType side;
+};
+
+EventChannels<LevelDelta, LEVEL_DELTA_RING_CAPACITY> levelDeltaChannels;
+
+inline void publishLevelDelta(int bookIndex, OrderType side, int priceTicks, int delta) {
+    if (levelDeltaChannels.active && delta != 0) {
+        LevelDelta record = { bookIndex, priceTicks, delta, side };
+        levelDeltaChannels.publish(record);
+    }
+}
+
+// Journal records
+//
+// Every accepted order, fill and cancellation is published for the journal
+// writer as one cache-line sized JournalRecord. The writer numbers records as
+// it appends them, so publishing takes no shared counter. A full ring makes
+// the matcher wait rather than lose a record.
+enum JournalRecordType { JOURNAL_ORDER = 1, JOURNAL_FILL, JOURNAL_CANCEL };
+
+const size_t JOURNAL_RING_CAPACITY = 1 << 14;
+
+// ORDER: orderId enters bookIndex on side at priceTicks for quantity, at
+// queuePosition in that level's queue.
+// FILL: quantity traded at priceTicks between the incoming orderId and the
+// resting otherOrderId. CANCEL: quantity taken off a resting orderId.
+struct JournalRecord {
+    uint64_t sequence;
+    uint64_t orderId;
+    uint64_t otherOrderId;
+    int bookIndex;
+    int priceTicks;
+    int quantity;
+    unsigned char type; // JournalRecordType
+    unsigned char side; // OrderType
+    unsigned char reserved[2];
+    uint32_t queuePosition;
+    unsigned char padding[20];
+};
+
+static_assert(sizeof(JournalRecord) == CACHE_LINE_SIZE, "journal records are one cache line");
+
+EventChannels<JournalRecord, JOURNAL_RING_CAPACITY> journalChannels;
+
+inline void publishJournal(JournalRecordType type, uint64_t orderId, uint64_t otherOrderId, int bookIndex,
+                           OrderType side, int priceTicks, int quantity, uint32_t queuePosition = 0) {
+    if (journalChannels.active) {
+        JournalRecord record = JournalRecord();
+        record.orderId = orderId;
+        record.otherOrderId = otherOrderId;
+        record.bookIndex = bookIndex;
+        record.priceTicks = priceTicks;
+        record.quantity = quantity;
+        record.type = (unsigned char)type;
+        record.side = (unsigned char)side;
+        record.queuePosition = queuePosition;
+        journalChannels.publish(record);
+    }
+}
+
+// Match statistics
+//
+// Per-thread contention counters for the fill protocol, kept on their own
+// cache line and summed on demand. casRetries counts fill-state CAS attempts
+// lost to another thread; abortedMatches counts fills that reserved their own
+// side but found the opposite order already taken. With NUMA placement,
+// localMatches and remoteMatches count orders matched by a thread on the
+// book's own node and on another node.
+struct alignas(CACHE_LINE_SIZE) MatchStats {
+    volatile unsigned long fills;
+    volatile unsigned long casRetries;
+    volatile unsigned long abortedMatches;
+    volatile unsigned long localMatches;
+    volatile unsigned long remoteMatches;
+    MatchStats* next;
+
+    MatchStats() : fills(0), casRetries(0), abortedMatches(0), localMatches(0), remoteMatches(0), next(nullptr) {}
+};
+
+MatchStats* volatile matchStatsList = nullptr;
+volatile unsigned long matchStatsGeneration = 0;
+thread_local MatchStats* localMatchStats = nullptr;
+thread_local unsigned long localMatchGeneration = 0;
+
+MatchStats& currentMatchStats() {
+    if (localMatchStats && localMatchGeneration == matchStatsGeneration) {
+        return *localMatchStats;
+    }
+    MatchStats* stats = newAlignedArray<MatchStats>(1);
+    MatchStats* oldHead;
+    do {
+        oldHead = matchStatsList;
+        stats->next = oldHead;
+    } while (!__sync_bool_compare_and_swap(&matchStatsList, oldHead, stats));
+    localMatchStats = stats;
+    localMatchGeneration = matchStatsGeneration;
+    return *stats;
+}
+
+MatchStats collectMatchStats() {
+    MatchStats total;
+    for (MatchStats* stats = matchStatsList; stats; stats = stats->next) {
+        total.fills += stats->fills;
+        total.casRetries += stats->casRetries;
+        total.abortedMatches += stats->abortedMatches;
+        total.localMatches += stats->localMatches;
+        total.remoteMatches += stats->remoteMatches;
+    }
+    return total;
+}
+
+// Only call while no thread is matching.
+void releaseMatchStats() {
+    MatchStats* stats = __sync_lock_test_and_set(&matchStatsList, (MatchStats*)nullptr);
+    __sync_fetch_and_add(&matchStatsGeneration, 1);
+    while (stats) {
+        MatchStats* next = stats->next;
+        deleteAlignedArray(stats, 1);
+        stats = next;
+    }
+}
+
+// Fill protocol
+//
+// Moves up to want shares from available to reserved and returns how many
+// were taken. Reserved shares are never handed back to another matcher: the
+// aggressor reserves its own order first and settles the unused part itself,
+// and a resting order only ever loses what was reserved against it.
+int reserveFill(volatile uint64_t* state, int want, MatchStats& stats) {
+    uint64_t expected = *state;
+    while (true) {
+        int available = availableOf(expected);
+        int take = (available < want) ? available : want;
+        if (take <= 0) {
+            return 0;
+        }
+        uint64_t desired = expected - (uint64_t)take + ((uint64_t)take << 32);
+        uint64_t seen = __sync_val_compare_and_swap(state, expected, desired);
+        if (seen == expected) {
+            return take;
+        }
+        stats.casRetries++;
+        expected = seen;
+    }
+}
+
+// Drops reserved shares, consuming used of them and making the rest available
+// again, or counting them in discarded if the order has been cancelled.
+// Returns the new state; the thread that sees fillsDone owns the order's index
+// entry.
+inline uint64_t settleFill(volatile uint64_t* state, int reserved, int used, int& discarded) {
+    uint64_t released = (uint64_t)reserved << 32;
+    discarded = 0;
+    if (reserved == used) {
+        return __sync_sub_and_fetch(state, released);
+    }
+    uint64_t expected = *state;
+    while (true) {
+        int returned = (expected & FILL_CANCELLED) ? 0 : reserved - used;
+        uint64_t desired = expected - released + (uint64_t)returned;
+        uint64_t seen = __sync_val_compare_and_swap(state, expected, desired);
+        if (seen == expected) {
+            discarded = reserved - used - returned;
+            return desired;
+        }
+        expected = seen;
+    }
+}
+
+// Top of book
+//
+// Each side's best price and the open quantity at that price are packed into
+// one 64-bit word (price ticks high, quantity low; 0 when the side is empty),
+// so readers get a consistent quote with a single atomic load. Writers bump
+// the side's change counter after every level change and recompute the word
+// from the first level until no other change has slipped in between; a change
+// at a price worse than the cached best cannot move the top and skips the
+// recompute, since any writer still recomputing will see its bump. Level
+// totals are 64-bit; a total above INT_MAX is quoted as INT_MAX.
+inline int saturateQuantity(int64_t quantity) { return quantity > INT_MAX ? INT_MAX : (int)quantity; }
+
+inline uint64_t packTop(int priceTicks, int64_t quantity) {
+    return ((uint64_t)(uint32_t)priceTicks << 32) | (uint32_t)saturateQuantity(quantity);
+}
+
+inline int topPriceOf(uint64_t top) { return (int)(top >> 32); }
+inline int topQuantityOf(uint64_t top) { return (int)(uint32_t)top; }
+
+// OrderBook class with matching logic
+//
+// Books are cache-line aligned and each side starts on its own line, so CAS
+// traffic on one side never invalidates the other side or a neighbouring
+// book. The top-of-book words get their own line, which quote readers share
+// with no CAS traffic. The cold fields are written at setup and only read
+// while matching; they get their own line so hot writes never evict them.
+// A book can opt into the single-writer array representation instead (see
+// "Structure-of-arrays book"); its orders then never touch the skip lists.
+class SoaOrderBook;
+extern TickerString* tickers;
+
+template <typename Visitor>
+void forEachArrayOrder(const SoaOrderBook& book, OrderType side, const TickerString& ticker, Visitor& visit);
+
+class alignas(CACHE_LINE_SIZE) OrderBook {
+private:
+    PriceLevelList buyOrders;
+    PriceLevelList sellOrders;
+    alignas(CACHE_LINE_SIZE) volatile uint64_t topOfBook[2]; // indexed by OrderType
+    volatile unsigned long topChanges[2];
+    alignas(CACHE_LINE_SIZE) double tickSize;
+    int priceDecimals;
+    int bookIndex;
+    SoaOrderBook* arrayBook; // set when the book uses the array representation
+
+    struct ArrayFills;
+    struct ArrayMoves;
+
+    OrderNode* findBestOpposite(const Order& order, PriceLevelList& oppositeOrders);
+    void matchArrayOrder(const Order& newOrder, MatchStats& stats);
+    void restoreArrayOrder(const Order& order);
+    void refreshArrayTop(OrderType side);
+
+    void arrayLevelChanged(OrderType side, int priceTicks, int delta) {
+        publishLevelDelta(bookIndex, side, priceTicks, delta);
+        refreshArrayTop(side);
+    }
+
+    void countPlacement(MatchStats& stats) const {
+        if (numaEnabled) {
+            if (bookNumaNode(bookIndex) == threadNumaNode) {
+                stats.localMatches++;
+            } else {
+                stats.remoteMatches++;
+            }
+        }
+    }
+
+    // Called after every change to a level's open quantity.
+    void levelChanged(OrderType side, int priceTicks, int delta) {
+        publishLevelDelta(bookIndex, side, priceTicks, delta);
+        refreshTop(side, priceTicks);
+    }
+
+    void refreshTop(OrderType side, int priceTicks) {
+        unsigned long seen = __sync_add_and_fetch(&topChanges[side], 1);
+        uint64_t top = topOfBook[side];
+        if (topQuantityOf(top) > 0 &&
+            ((side == BUY) ? priceTicks < topPriceOf(top) : priceTicks > topPriceOf(top))) {
+            return;
+        }
+        PriceLevelList& levels = (side == BUY) ? buyOrders : sellOrders;
+        while (true) {
+            PriceLevel* best = levels.first();
+            int64_t quantity = best ? best->openQuantity : 0;
+            __atomic_store_n(&topOfBook[side], quantity > 0 ? packTop(best->priceTicks, quantity) : 0,
+                             __ATOMIC_RELEASE);
+            unsigned long now = __atomic_load_n(&topChanges[side], __ATOMIC_ACQUIRE);
+            if (now == seen) {
+                return;
+            }
+            seen = now;
+        }
+    }
+
+public:
+    OrderBook()
+        : buyOrders(true), sellOrders(false), tickSize(DEFAULT_TICK_SIZE), priceDecimals(2), bookIndex(0),
+          arrayBook(nullptr) {
+        topOfBook[BUY] = topOfBook[SELL] = 0;
+        topChanges[BUY] = topChanges[SELL] = 0;
+    }
+
+    ~OrderBook();
+
+    // Switches the book to the array representation, with the widest scan
+    // kernel the CPU runs. Must be called before the first order arrives,
+    // and the book must then have a single writer: its shard, or the thread
+    // restoring or replaying into it.
+    void useArrayBook();
+    bool isArrayBook() const { return arrayBook != nullptr; }
+
+    // Array books address orders by id. cancelArrayOrder returns the
+    // quantity cancelled and sets side; reduceArrayOrder lowers an order in
+    // place and fails when less than newQuantity is left.
+    int cancelArrayOrder(uint64_t orderId, OrderType& side);
+    bool reduceArrayOrder(uint64_t orderId, int newQuantity);
+    int arrayOrderQuantity(uint64_t orderId) const;
+
+    // Packed best price and quantity of a side (see packTop); wait-free.
+    uint64_t topOf(OrderType side) const { return __atomic_load_n(&topOfBook[side], __ATOMIC_ACQUIRE); }
+
+    void setBookIndex(int index) { bookIndex = index; }
+
+    // Must be set before the first order for this ticker arrives.
+    void setTickSize(double size) {
+        tickSize = size;
+        priceDecimals = 0;
+        double scaled = size;
+        while (priceDecimals < 8 && fabs(scaled - llround(scaled)) > 1e-9) {
+            scaled *= 10;
+            priceDecimals++;
+        }
+    }
+
+    // False for a price that is not finite, rounds to less than one tick, or
+    // has more ticks than an int holds; NaN fails every comparison.
+    bool toTicks(double price, int& priceTicks) const {
+        double ticks = price / tickSize;
+        if (!(ticks >= 0.5 && ticks < (double)INT_MAX)) {
+            return false;
+        }
+        priceTicks = (int)llround(ticks);
+        return true;
+    }
+
+    double toPrice(int priceTicks) const { return priceTicks * tickSize; }
+    int getPriceDecimals() const { return priceDecimals; }
+
+    void addOrder(const Order& newOrder) {
+        EpochGuard guard;
+        matchOrder(newOrder, currentMatchStats());
+    }
+
+    // Books the order and matches it against the opposite side. Must be
+    // called inside an EpochGuard; batch paths enter one guard for many
+    // orders.
+    void matchOrder(const Order& newOrder, MatchStats& stats) {
+        if (arrayBook) {
+            matchArrayOrder(newOrder, stats);
+            return;
+        }
+        PriceLevelList& orders = (newOrder.orderType == BUY) ? buyOrders : sellOrders;
+        PriceLevelList& oppositeOrders = (newOrder.orderType == BUY) ? sellOrders : buyOrders;
+
+        countPlacement(stats);
+        StageTimer appendTimer(STAGE_APPEND);
+        PriceLevel* level = orders.acquireLevel(newOrder.priceTicks, newOrder.availableQuantity());
+        OrderNode* newNode = level->orders.append(newOrder, level, bookNumaNode(bookIndex));
+        appendTimer.stop();
+        // Journaled once booked, so the record carries the order's queue
+        // position; replay sorts on it to restore time priority.
+        publishJournal(JOURNAL_ORDER, newOrder.orderId, 0, bookIndex, newOrder.orderType, newOrder.priceTicks,
+                       newOrder.availableQuantity(), newNode->order.queuePosition);
+        int filled = 0;
+
+        while (newNode->order.availableQuantity() > 0) {
+            StageTimer matchTimer(STAGE_MATCH);
+            OrderNode* bestNode = findBestOpposite(newNode->order, oppositeOrders);
+            if (!bestNode) {
+                break;
+            }
+            Order* bestOpposite = &bestNode->order;
+
+            // Reserve our own side first so that a concurrent matcher can only
+            // take what we have not claimed, then as much of the opposite
+            // order as we hold.
+            int reserved = reserveFill(&newNode->order.fillState, bestOpposite->availableQuantity(), stats);
+            if (reserved == 0) {
+                continue;
+            }
+            int tradeQty = reserveFill(&bestOpposite->fillState, reserved, stats);
+            int discarded;
+            if (fillsDone(settleFill(&newNode->order.fillState, reserved, tradeQty, discarded))) {
+                orderIndex.erase(newNode);
+            }
+            if (discarded > 0) {
+                releaseCancelled(newNode, discarded);
+            }
+            if (tradeQty == 0) {
+                stats.abortedMatches++;
+                continue;
+            }
+            if (fillsDone(settleFill(&bestOpposite->fillState, tradeQty, tradeQty, discarded))) {
+                orderIndex.erase(bestNode);
+            }
+            stats.fills++;
+
+            oppositeOrders.releaseQuantity(bestNode->level, tradeQty);
+            orders.releaseQuantity(level, tradeQty);
+            filled += tradeQty;
+            matchTimer.stop();
+            StageTimer fillTimer(STAGE_FILL);
+            levelChanged(bestOpposite->orderType, bestOpposite->priceTicks, -tradeQty);
+            TradeRecord trade = { newNode->order.ticker, bookIndex, tradeQty,
+                                  bestOpposite->priceTicks, newNode->order.orderId,
+                                  bestOpposite->orderId, newNode->order.orderType };
+            publishTrade(trade);
+            publishJournal(JOURNAL_FILL, newNode->order.orderId, bestOpposite->orderId, bookIndex,
+                           newNode->order.orderType, bestOpposite->priceTicks, tradeQty);
+        }
+        // The incoming order's own level gets one net change for what rests,
+        // even when nothing does: its fills may have been observed halfway.
+        levelChanged(newOrder.orderType, newOrder.priceTicks, newOrder.availableQuantity() - filled);
+    }
+
+    // Takes everything still available off a resting order, marks it
+    // cancelled and returns how much was cancelled. Shares reserved by a fill
+    // in flight are left to it; whatever that fill does not use is discarded.
+    int cancelOrder(OrderNode* node) {
+        uint64_t state = node->order.fillState;
+        while (true) {
+            if (availableOf(state) == 0) {
+                return 0;
+            }
+            uint64_t desired = (state & ~(uint64_t)0xFFFFFFFF) | FILL_CANCELLED;
+            uint64_t seen = __sync_val_compare_and_swap(&node->order.fillState, state, desired);
+            if (seen == state) {
+                break;
+            }
+            state = seen;
+        }
+        int cancelled = availableOf(state);
+        if (reservedOf(state) == 0) {
+            orderIndex.erase(node);
+        }
+        releaseCancelled(node, cancelled);
+        return cancelled;
+    }
+
+    // Takes cancelled shares off the order's level and reports them.
+    void releaseCancelled(OrderNode* node, int quantity) {
+        sideOf(node->order).releaseQuantity(node->level, quantity);
+        levelChanged(node->order.orderType, node->order.priceTicks, -quantity);
+        publishJournal(JOURNAL_CANCEL, node->order.orderId, 0, bookIndex, node->order.orderType,
+                       node->order.priceTicks, quantity);
+    }
+
+    // Lowers the available quantity of a resting order in place, keeping its
+    // queue position. Fails when less than newQuantity is left.
+    bool reduceOrder(OrderNode* node, int newQuantity) {
+        uint64_t expected = node->order.fillState;
+        while (true) {
+            int reduction = availableOf(expected) - newQuantity;
+            if (reduction < 0) {
+                return false;
+            }
+            if (reduction == 0) {
+                return true;
+            }
+            uint64_t seen = __sync_val_compare_and_swap(&node->order.fillState, expected, expected - reduction);
+            if (seen == expected) {
+                if (fillsDone(expected - reduction)) {
+                    orderIndex.erase(node);
+                }
+                sideOf(node->order).releaseQuantity(node->level, reduction);
+                levelChanged(node->order.orderType, node->order.priceTicks, -reduction);
+                publishJournal(JOURNAL_CANCEL, node->order.orderId, 0, bookIndex, node->order.orderType,
+                               node->order.priceTicks, reduction);
+                return true;
+            }
+            expected = seen;
+        }
+    }
+
+    // Books an order behind those already at its price without matching it,
+    // for restoring a book that was uncrossed when it was saved. Must be
+    // called inside an EpochGuard.
+    void restoreOrder(const Order& order) {
+        if (arrayBook) {
+            restoreArrayOrder(order);
+            return;
+        }
+        PriceLevelList& orders = sideOf(order);
+        PriceLevel* level = orders.acquireLevel(order.priceTicks, order.availableQuantity());
+        level->orders.append(order, level, bookNumaNode(bookIndex));
+        levelChanged(order.orderType, order.priceTicks, order.availableQuantity());
+    }
+
+    // Visits a side's orders with shares available, best price first and in
+    // queue order within a price. Only consistent while no thread is
+    // matching on the book.
+    template <typename Visitor>
+    void forEachRestingOrder(OrderType side, Visitor& visit) {
+        if (arrayBook) {
+            forEachArrayOrder(*arrayBook, side, tickers[bookIndex], visit);
+            return;
+        }
+        PriceLevelList& levels = (side == BUY) ? buyOrders : sellOrders;
+        for (PriceLevel* level = levels.first(); level; level = levels.nextLevel(level)) {
+            level->orders.forEach(visit);
+        }
+    }
+
+private:
+    PriceLevelList& sideOf(const Order& order) { return (order.orderType == BUY) ? buyOrders : sellOrders; }
+};
+
+// Walks opposite levels from the best price while they still cross, returning
+// the oldest resting order with quantity left at the first level that has
+// one. Levels are sorted and each level is a FIFO, so nothing is scanned.
+OrderNode* OrderBook::findBestOpposite(const Order& order, PriceLevelList& oppositeOrders) {
+    for (PriceLevel* level = oppositeOrders.first(); level; level = oppositeOrders.nextLevel(level)) {
+        if ((order.orderType == BUY && level->priceTicks > order.priceTicks) ||
+            (order.orderType == SELL && level->priceTicks < order.priceTicks)) {
+            return nullptr;
+        }
+        OrderNode* node = level->orders.front();
+        if (node) {
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+// Structure-of-arrays book
+//
+// An alternative, single-writer representation for mid-depth books: resting
+// orders stay in arrival order with their prices and quantities in separate
+// contiguous, cache-line aligned arrays, and the best opposite order is
+// found by scanning them instead of keeping anything sorted. A scan is a
+// min/max reduction over the live prices followed by a search for the first
+// live entry at that price, which is the oldest one, so price-time priority
+// holds. Kernels for AVX2 and AVX-512 are compiled with target attributes
+// and picked at runtime; the scalar kernel is the fallback everywhere else.
+// Filled entries keep quantity 0 until the side is compacted.
+enum SoaKernel { SOA_SCALAR, SOA_AVX2, SOA_AVX512 };
+
+typedef int (*SoaScanKernel)(const int* prices, const int* quantities, int count, bool highest);
+
+template <bool HIGHEST>
+int soaBestScalarImpl(const int* prices, const int* quantities, int count) {
+    int best = -1;
+    int bestPrice = 0;
+    for (int i = 0; i < count; i++) {
+        if (quantities[i] > 0 && (best < 0 || (HIGHEST ? prices[i] > bestPrice : prices[i] < bestPrice))) {
+            best = i;
+            bestPrice = prices[i];
+        }
+    }
+    return best;
+}
+
+int soaBestScalar(const int* prices, const int* quantities, int count, bool highest) {
+    return highest ? soaBestScalarImpl<true>(prices, quantities, count)
+                   : soaBestScalarImpl<false>(prices, quantities, count);
+}
+
+// First live entry at exactly priceTicks, starting from index start.
+int soaFirstAtPrice(const int* prices, const int* quantities, int start, int count, int priceTicks) {
+    for (int i = start; i < count; i++) {
+        if (quantities[i] > 0 && prices[i] == priceTicks) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef SOA_X86_KERNELS
+template <bool HIGHEST>
+__attribute__((target("avx2"))) int soaBestAvx2Impl(const int* prices, const int* quantities, int count) {
+    const int sentinel = HIGHEST ? INT_MIN : INT_MAX;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i best = _mm256_set1_epi32(sentinel);
+    bool found = false;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i price = _mm256_load_si256(reinterpret_cast<const __m256i*>(prices + i));
+        __m256i live = _mm256_cmpgt_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(quantities + i)), zero);
+        price = _mm256_blendv_epi8(_mm256_set1_epi32(sentinel), price, live);
+        best = HIGHEST ? _mm256_max_epi32(best, price) : _mm256_min_epi32(best, price);
+        found |= _mm256_movemask_epi8(live) != 0;
+    }
+    int lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), best);
+    int bestPrice = sentinel;
+    for (int lane = 0; lane < 8; lane++) {
+        bestPrice = HIGHEST ? (lanes[lane] > bestPrice ? lanes[lane] : bestPrice)
+                            : (lanes[lane] < bestPrice ? lanes[lane] : bestPrice);
+    }
+    for (int tail = i; tail < count; tail++) {
+        if (quantities[tail] > 0) {
+            found = true;
+            bestPrice = HIGHEST ? (prices[tail] > bestPrice ? prices[tail] : bestPrice)
+                                : (prices[tail] < bestPrice ? prices[tail] : bestPrice);
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+    const __m256i target = _mm256_set1_epi32(bestPrice);
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m256i hit = _mm256_and_si256(
+            _mm256_cmpeq_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(prices + i)), target),
+            _mm256_cmpgt_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(quantities + i)), zero));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return soaFirstAtPrice(prices, quantities, i, count, bestPrice);
+}
+
+__attribute__((target("avx2"))) int soaBestAvx2(const int* prices, const int* quantities, int count, bool highest) {
+    return highest ? soaBestAvx2Impl<true>(prices, quantities, count)
+                   : soaBestAvx2Impl<false>(prices, quantities, count);
+}
+
+template <bool HIGHEST>
+__attribute__((target("avx512f"))) int soaBestAvx512Impl(const int* prices, const int* quantities, int count) {
+    const int sentinel = HIGHEST ? INT_MIN : INT_MAX;
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i best = _mm512_set1_epi32(sentinel);
+    __mmask16 anyLive = 0;
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i price = _mm512_load_si512(prices + i);
+        __mmask16 live = _mm512_cmpgt_epi32_mask(_mm512_load_si512(quantities + i), zero);
+        best = HIGHEST ? _mm512_mask_max_epi32(best, live, best, price) : _mm512_mask_min_epi32(best, live, best, price);
+        anyLive |= live;
+    }
+    bool found = anyLive != 0;
+    // Reduce through memory: GCC's _mm512_reduce_* helpers trip -Wuninitialized.
+    int lanes[16];
+    _mm512_storeu_si512(lanes, best);
+    int bestPrice = sentinel;
+    for (int lane = 0; lane < 16; lane++) {
+        bestPrice = HIGHEST ? (lanes[lane] > bestPrice ? lanes[lane] : bestPrice)
+                            : (lanes[lane] < bestPrice ? lanes[lane] : bestPrice);
+    }
+    for (int tail = i; tail < count; tail++) {
+        if (quantities[tail] > 0) {
+            found = true;
+            bestPrice = HIGHEST ? (prices[tail] > bestPrice ? prices[tail] : bestPrice)
+                                : (prices[tail] < bestPrice ? prices[tail] : bestPrice);
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+    const __m512i target = _mm512_set1_epi32(bestPrice);
+    for (i = 0; i + 16 <= count; i += 16) {
+        __mmask16 live = _mm512_cmpgt_epi32_mask(_mm512_load_si512(quantities + i), zero);
+        __mmask16 hit = _mm512_mask_cmpeq_epi32_mask(live, _mm512_load_si512(prices + i), target);
+        if (hit) {
+            return i + __builtin_ctz(hit);
+        }
+    }
+    return soaFirstAtPrice(prices, quantities, i, count, bestPrice);
+}
+
+__attribute__((target("avx512f"))) int soaBestAvx512(const int* prices, const int* quantities, int count, bool highest) {
+    return highest ? soaBestAvx512Impl<true>(prices, quantities, count)
+                   : soaBestAvx512Impl<false>(prices, quantities, count);
+}
+#endif
+
+bool soaKernelSupported(SoaKernel kernel) {
+#ifdef SOA_X86_KERNELS
+    __builtin_cpu_init();
+    if (kernel == SOA_AVX512) {
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (kernel == SOA_AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return kernel == SOA_SCALAR;
+}
+
+SoaScanKernel soaScanFunction(SoaKernel kernel) {
+#ifdef SOA_X86_KERNELS
+    if (kernel == SOA_AVX512) {
+        return soaBestAvx512;
+    }
+    if (kernel == SOA_AVX2) {
+        return soaBestAvx2;
+    }
+#endif
+    return soaBestScalar;
+}
+
+// Widest kernel this CPU runs.
+SoaKernel bestSoaKernel() {
+    if (soaKernelSupported(SOA_AVX512)) {
+        return SOA_AVX512;
+    }
+    return soaKernelSupported(SOA_AVX2) ? SOA_AVX2 : SOA_SCALAR;
+}
+
+const char* soaKernelName(SoaKernel kernel) {
+    return kernel == SOA_AVX512 ? "avx512" : kernel == SOA_AVX2 ? "avx2" : "scalar";
+}
+
+// An array slot names an entry of an array book: its index on its side, with
+// the side in the low bit. The order index keeps each array-booked order's
+// slot, so cancels and amendments go straight to the entry.
+inline int soaSlot(OrderType side, int index) { return (index << 1) | side; }
+inline OrderType soaSlotSide(int slot) { return (OrderType)(slot & 1); }
+inline int soaSlotIndex(int slot) { return slot >> 1; }
+
+// Arrays are padded to whole 64-byte blocks so kernels can use aligned loads.
+class SoaBookSide {
+public:
+    int* prices;
+    int* quantities;
+    uint64_t* orderIds;
+    int count;
+    int live;
+    uint32_t arrivals; // orders entered on this side; the next queue position
+
+    SoaBookSide()
+        : prices(nullptr), quantities(nullptr), orderIds(nullptr), count(0), live(0), arrivals(0), capacity(0) {}
+
+    ~SoaBookSide() {
+        free(prices);
+        free(quantities);
+        free(orderIds);
+    }
+
+    void append(int priceTicks, int quantity, uint64_t orderId) {
+        if (count == capacity) {
+            grow();
+        }
+        prices[count] = priceTicks;
+        quantities[count] = quantity;
+        orderIds[count] = orderId;
+        count++;
+        live++;
+    }
+
+    // True when index is the live entry for orderId.
+    bool holds(int index, uint64_t orderId) const {
+        return index >= 0 && index < count && orderIds[index] == orderId && quantities[index] > 0;
+    }
+
+    // Sets a live entry's quantity; 0 takes it off the side.
+    void setQuantity(int index, int quantity) {
+        quantities[index] = quantity;
+        if (quantity == 0) {
+            live--;
+        }
+    }
+
+    // Drops filled entries once they outnumber live ones, keeping arrival
+    // order, and reports every entry that moves as moves.moved(orderId,
+    // newSlot).
+    template <typename Moves>
+    void compactIfSparse(OrderType side, Moves& moves) {
+        if (count < 64 || count - live <= live) {
+            return;
+        }
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (quantities[i] > 0) {
+                if (kept != i) {
+                    prices[kept] = prices[i];
+                    quantities[kept] = quantities[i];
+                    orderIds[kept] = orderIds[i];
+                    moves.moved(orderIds[kept], soaSlot(side, kept));
+                }
+                kept++;
+            }
+        }
+        count = kept;
+    }
+
+private:
+    int capacity;
+
+    template <typename T>
+    static T* reallocAligned(T* old, int oldCount, int newCapacity) {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, CACHE_LINE_SIZE, newCapacity * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        T* items = static_cast<T*>(memory);
+        if (old) {
+            memcpy(items, old, oldCount * sizeof(T));
+        }
+        free(old);
+        return items;
+    }
+
+    void grow() {
+        capacity = capacity ? capacity * 2 : 64;
+        prices = reallocAligned(prices, count, capacity);
+        quantities = reallocAligned(quantities, count, capacity);
+        orderIds = reallocAligned(orderIds, count, capacity);
+    }
+};
+
+struct NoSoaFills {
+    void fill(uint64_t, int, int, bool) {}
+    void moved(uint64_t, int) {}
+};
+
+class SoaOrderBook {
+private:
+    SoaBookSide sides[2]; // indexed by OrderType
+    SoaScanKernel scan;
+
+public:
+    explicit SoaOrderBook(SoaKernel kernel) : scan(soaScanFunction(kernel)) {}
+
+    const SoaBookSide& side(OrderType type) const { return sides[type]; }
+
+    // Matches the order against the opposite side and rests what is left.
+    // Returns the traded quantity. Not safe for concurrent callers. Each fill
+    // is reported as fills.fill(restingId, priceTicks, quantity, restingDone),
+    // and each resting order moved by compaction as fills.moved(orderId,
+    // slot).
+    template <typename Fills>
+    int matchOrder(const Order& order, Fills& fills) {
+        SoaBookSide& opposite = sides[order.orderType == BUY ? SELL : BUY];
+        int remaining = order.availableQuantity();
+        while (remaining > 0) {
+            int best = scan(opposite.prices, opposite.quantities, opposite.count, order.orderType == SELL);
+            if (best < 0 || (order.orderType == BUY ? opposite.prices[best] > order.priceTicks
+                                                    : opposite.prices[best] < order.priceTicks)) {
+                break;
+            }
+            int tradeQty = (remaining < opposite.quantities[best]) ? remaining : opposite.quantities[best];
+            opposite.setQuantity(best, opposite.quantities[best] - tradeQty);
+            remaining -= tradeQty;
+            fills.fill(opposite.orderIds[best], opposite.prices[best], tradeQty, opposite.quantities[best] == 0);
+        }
+        opposite.compactIfSparse(order.orderType == BUY ? SELL : BUY, fills);
+        sides[order.orderType].arrivals++;
+        if (remaining > 0) {
+            sides[order.orderType].append(order.priceTicks, remaining, order.orderId);
+        }
+        return order.availableQuantity() - remaining;
+    }
+
+    int matchOrder(const Order& order) {
+        NoSoaFills none;
+        return matchOrder(order, none);
+    }
+
+    // Queue position the next order entered on side will take.
+    uint32_t nextPosition(OrderType side) const { return sides[side].arrivals; }
+
+    // Slot of the order most recently rested on side.
+    int newestSlot(OrderType side) const { return soaSlot(side, sides[side].count - 1); }
+
+    // Rests an order without matching it.
+    void rest(const Order& order) {
+        sides[order.orderType].arrivals++;
+        sides[order.orderType].append(order.priceTicks, order.availableQuantity(), order.orderId);
+    }
+
+    // Sets the quantity of the live order orderId at slot. Returns the change
+    // (old minus new), or -1 when the slot does not hold it; priceTicks is the
+    // order's price. Entries moved by compaction are reported to moves.
+    template <typename Moves>
+    int setQuantity(int slot, uint64_t orderId, int quantity, int& priceTicks, Moves& moves) {
+        OrderType side = soaSlotSide(slot);
+        SoaBookSide& own = sides[side];
+        int index = soaSlotIndex(slot);
+        if (!own.holds(index, orderId)) {
+            return -1;
+        }
+        int change = own.quantities[index] - quantity;
+        priceTicks = own.prices[index];
+        own.setQuantity(index, quantity);
+        own.compactIfSparse(side, moves);
+        return change;
+    }
+
+    // Quantity of the live order orderId at slot, or 0.
+    int quantityAt(int slot, uint64_t orderId) const {
+        const SoaBookSide& own = sides[soaSlotSide(slot)];
+        int index = soaSlotIndex(slot);
+        return own.holds(index, orderId) ? own.quantities[index] : 0;
+    }
+
+    // Best live price of a side and the total quantity resting at it; false
+    // when the side is empty.
+    bool best(OrderType type, int& priceTicks, int64_t& quantity) const {
+        const SoaBookSide& own = sides[type];
+        int index = scan(own.prices, own.quantities, own.count, type == BUY);
+        if (index < 0) {
+            return false;
+        }
+        priceTicks = own.prices[index];
+        quantity = 0;
+        for (int i = index; i < own.count; i++) {
+            if (own.prices[i] == priceTicks && own.quantities[i] > 0) {
+                quantity += own.quantities[i];
+            }
+        }
+        return true;
+    }
+};
+
+// Entry of a side in price-time order, for visiting an array book the way a
+// skip-list book is visited: best price first, arrival order within a price.
+struct SoaRanked {
+    int sortPrice; // the price, negated on the bid side
+    int index;
+};
+
+int compareSoaRanked(const void* left, const void* right) {
+    const SoaRanked* a = static_cast<const SoaRanked*>(left);
+    const SoaRanked* b = static_cast<const SoaRanked*>(right);
+    if (a->sortPrice != b->sortPrice) {
+        return a->sortPrice < b->sortPrice ? -1 : 1;
+    }
+    return a->index - b->index;
+}
+
+// Visits a side's live orders in price-time order. Only consistent while the
+// book's writer is idle.
+template <typename Visitor>
+void forEachArrayOrder(const SoaOrderBook& book, OrderType side, const TickerString& ticker, Visitor& visit) {
+    const SoaBookSide& own = book.side(side);
+    SoaRanked* ranked = static_cast<SoaRanked*>(malloc((own.count + 1) * sizeof(SoaRanked)));
+    int live = 0;
+    for (int i = 0; i < own.count; i++) {
+        if (own.quantities[i] > 0) {
+            SoaRanked entry = { side == BUY ? -own.prices[i] : own.prices[i], i };
+            ranked[live++] = entry;
+        }
+    }
+    qsort(ranked, live, sizeof(SoaRanked), compareSoaRanked);
+    for (int i = 0; i < live; i++) {
+        int index = ranked[i].index;
+        visit(Order(side, ticker, own.quantities[index], own.prices[index], own.orderIds[index]));
+    }
+    free(ranked);
+}
+
+// Array books
+//
+// OrderBook's array representation. The shard owning the book is its only
+// writer, so fills settle without CAS and the top of book is recomputed from
+// the arrays after each change. Orders publish the same trades, level deltas
+// and journal records as on the skip lists, and rest in the order index as
+// array-booked entries, which cancels and amendments route by.
+OrderBook::~OrderBook() {
+    delete arrayBook;
+}
+
+void OrderBook::useArrayBook() {
+    if (!arrayBook) {
+        arrayBook = new SoaOrderBook(bestSoaKernel());
+    }
+}
+
+struct OrderBook::ArrayFills {
+    OrderBook& book;
+    const Order& incoming;
+    MatchStats& stats;
+
+    void fill(uint64_t restingId, int priceTicks, int quantity, bool restingDone) {
+        StageTimer fillTimer(STAGE_FILL);
+        stats.fills++;
+        if (restingDone) {
+            orderIndex.erase(restingId);
+        }
+        book.arrayLevelChanged(incoming.orderType == BUY ? SELL : BUY, priceTicks, -quantity);
+        TradeRecord trade = { incoming.ticker, book.bookIndex, quantity, priceTicks, incoming.orderId, restingId,
+                              incoming.orderType };
+        publishTrade(trade);
+        publishJournal(JOURNAL_FILL, incoming.orderId, restingId, book.bookIndex, incoming.orderType, priceTicks,
+                       quantity);
+    }
+
+    void moved(uint64_t orderId, int slot) { orderIndex.insertArrayBooked(orderId, book.bookIndex, slot); }
+};
+
+// Keeps the order index's array slots current when a cancel or amendment
+// compacts a side.
+struct OrderBook::ArrayMoves {
+    int bookIndex;
+
+    void moved(uint64_t orderId, int slot) { orderIndex.insertArrayBooked(orderId, bookIndex, slot); }
+};
+
+void OrderBook::matchArrayOrder(const Order& newOrder, MatchStats& stats) {
+    countPlacement(stats);
+    publishJournal(JOURNAL_ORDER, newOrder.orderId, 0, bookIndex, newOrder.orderType, newOrder.priceTicks,
+                   newOrder.availableQuantity(), arrayBook->nextPosition(newOrder.orderType));
+    ArrayFills fills = { *this, newOrder, stats };
+    int remaining = newOrder.availableQuantity() - arrayBook->matchOrder(newOrder, fills);
+    if (remaining > 0) {
+        orderIndex.insertArrayBooked(newOrder.orderId, bookIndex, arrayBook->newestSlot(newOrder.orderType));
+        arrayLevelChanged(newOrder.orderType, newOrder.priceTicks, remaining);
+    } else {
+        orderIndex.erase(newOrder.orderId);
+    }
+}
+
+void OrderBook::restoreArrayOrder(const Order& order) {
+    arrayBook->rest(order);
+    orderIndex.insertArrayBooked(order.orderId, bookIndex, arrayBook->newestSlot(order.orderType));
+    arrayLevelChanged(order.orderType, order.priceTicks, order.availableQuantity());
+}
+
+void OrderBook::refreshArrayTop(OrderType side) {
+    int priceTicks;
+    int64_t quantity;
+    uint64_t top = arrayBook->best(side, priceTicks, quantity) ? packTop(priceTicks, quantity) : 0;
+    __atomic_store_n(&topOfBook[side], top, __ATOMIC_RELEASE);
+}
+
+int OrderBook::cancelArrayOrder(uint64_t orderId, OrderType& side) {
+    int slot = orderIndex.findArraySlot(orderId);
+    if (slot < 0) {
+        return 0;
+    }
+    int priceTicks;
+    ArrayMoves moves = { bookIndex };
+    int cancelled = arrayBook->setQuantity(slot, orderId, 0, priceTicks, moves);
+    if (cancelled <= 0) {
+        return 0;
+    }
+    side = soaSlotSide(slot);
+    orderIndex.erase(orderId);
+    arrayLevelChanged(side, priceTicks, -cancelled);
+    publishJournal(JOURNAL_CANCEL, orderId, 0, bookIndex, side, priceTicks, cancelled);
+    return cancelled;
+}
+
+bool OrderBook::reduceArrayOrder(uint64_t orderId, int newQuantity) {
+    int slot = orderIndex.findArraySlot(orderId);
+    int quantity = slot >= 0 ? arrayBook->quantityAt(slot, orderId) : 0;
+    if (quantity < newQuantity || quantity == 0) {
+        return false;
+    }
+    if (quantity == newQuantity) {
+        return true;
+    }
+    OrderType side = soaSlotSide(slot);
+    int priceTicks = 0;
+    ArrayMoves moves = { bookIndex };
+    int reduction = arrayBook->setQuantity(slot, orderId, newQuantity, priceTicks, moves);
+    if (newQuantity == 0) {
+        orderIndex.erase(orderId);
+    }
+    arrayLevelChanged(side, priceTicks, -reduction);
+    publishJournal(JOURNAL_CANCEL, orderId, 0, bookIndex, side, priceTicks, reduction);
+    return true;
+}
+
+int OrderBook::arrayOrderQuantity(uint64_t orderId) const {
+    int slot = orderIndex.findArraySlot(orderId);
+    return slot >= 0 ? arrayBook->quantityAt(slot, orderId) : 0;
+}
+
+// Global order books and utility functions
+//
+// The number of books is set at runtime and books are created lazily:
+// orderBooks holds one pointer per ticker of the universe, and a book is
+// allocated the first time an order or a setting reaches its ticker, then
+// installed with a CAS so racing threads agree on a single instance. Memory
+// and startup cost follow the active instruments, not the universe size.
+int numBooks = 0;
+OrderBook* volatile* orderBooks = nullptr;
+
+// Books placed in a NUMA arena are only destroyed; the arena owns the memory.
+void releaseBook(OrderBook* book) {
+    if (numaEnabled) {
+        book->~OrderBook();
+    } else {
+        deleteAlignedArray(book, 1);
+    }
+}
+
+// The book at index, or nullptr when nothing has touched it yet.
+inline OrderBook* findBook(int index) { return __atomic_load_n(&orderBooks[index], __ATOMIC_ACQUIRE); }
+
+OrderBook& bookAt(int index) {
+    OrderBook* book = findBook(index);
+    if (book) {
+        return *book;
+    }
+    OrderBook* created;
+    if (numaEnabled) {
+        created = new (numaAllocate(bookNumaNode(index), sizeof(OrderBook))) OrderBook();
+    } else {
+        created = newAlignedArray<OrderBook>(1);
+    }
+    created->setBookIndex(index);
+    if (__sync_bool_compare_and_swap(&orderBooks[index], (OrderBook*)nullptr, created)) {
+        return *created;
+    }
+    releaseBook(created);
+    return *findBook(index);
+}
+
+// preallocatedNodes is the expected number of resting orders: nodes for them
+// are carved up front and the order index is sized for them. Both grow on
+// demand past it, so it is a warm-up hint rather than a limit.
+void initOrderBooks(int bookCount, size_t preallocatedNodes = 0) {
+    orderIndex.reset(preallocatedNodes);
+    numBooks = bookCount;
+    orderBooks = static_cast<OrderBook* volatile*>(calloc(bookCount, sizeof(OrderBook*)));
+    preallocateOrderNodes(preallocatedNodes);
+}
+
+void cleanupOrderBooks() {
+    drainEpochs();
+    for (int i = 0; i < numBooks; i++) {
+        if (orderBooks[i]) {
+            releaseBook(orderBooks[i]);
+        }
+    }
+    free((void*)orderBooks);
+    orderBooks = nullptr;
+    numBooks = 0;
+    releaseNodeSlabs();
+    releaseNumaArenas();
+    releaseMatchStats();
+    orderIndex.release();
+}
+
+// Dense book index of a ticker in the universe, or -1 for unknown tickers.
+int getOrderBookIndex(const TickerString& ticker) {
+    return tickerIndex.lookup(ticker);
+}
+
+// Sharded matching
+//
+// In sharded mode every book is owned by exactly one matching thread
+// (book index modulo the shard count). addOrder only routes the order onto
+// the owning shard's ingress ring, so CAS traffic on a book never leaves the
+// core that owns it. Cancels and amendments travel the same ring as their own
+// messages, so the shard is the only thread that writes its books and
+// applies them after the entry of the order they name. With NUMA placement shard s runs on node s % nodeCount;
+// a shard count that is a multiple of the node count then keeps every book
+// on its shard's node.
+const size_t SHARD_RING_CAPACITY = 1 << 14;
+
+enum ShardCommand { SHARD_ADD, SHARD_CANCEL, SHARD_REDUCE, SHARD_REPLACE };
+
+// SHARD_ADD books order. The others name their order by targetId:
+// SHARD_REDUCE lowers it to quantity in place, and SHARD_REPLACE cancels it
+// and, if anything was left, enters newId for quantity at priceTicks.
+struct ShardMessage {
+    Order order;
+    int bookIndex;
+    ShardCommand command;
+    uint64_t targetId;
+    uint64_t newId;
+    int quantity;
+    int priceTicks;
+
+    ShardMessage() : order(BUY, TickerString(), 0, 0, 0), bookIndex(0), command(SHARD_ADD), targetId(0), newId(0),
+                     quantity(0), priceTicks(0) {}
+    ShardMessage(const Order& ord, int idx) : order(ord), bookIndex(idx), command(SHARD_ADD), targetId(0), newId(0),
+                                              quantity(0), priceTicks(0) {}
+    ShardMessage(ShardCommand cmd, int idx, uint64_t target)
+        : order(BUY, TickerString(), 0, 0, 0), bookIndex(idx), command(cmd), targetId(target), newId(0), quantity(0),
+          priceTicks(0) {}
+};
+
+// Shards drain up to SHARD_BATCH messages at a time and match them under one
+// epoch guard.
+const int SHARD_BATCH = 64;
+
+// deferred holds commands that overtook the entry of the order they name.
+// Only the shard thread touches it.
+struct alignas(CACHE_LINE_SIZE) MatchingShard {
+    MpscRing<ShardMessage> ring;
+    std::thread thread;
+    ShardMessage* deferred;
+    int deferredCount;
+    int deferredCapacity;
+
+    MatchingShard() : ring(SHARD_RING_CAPACITY), deferred(nullptr), deferredCount(0), deferredCapacity(0) {}
+    ~MatchingShard() { delete[] deferred; }
+
+    void defer(const ShardMessage& message) {
+        if (deferredCount == deferredCapacity) {
+            deferredCapacity = deferredCapacity ? deferredCapacity * 2 : SHARD_BATCH;
+            ShardMessage* grown = new ShardMessage[deferredCapacity];
+            for (int i = 0; i < deferredCount; i++) {
+                grown[i] = deferred[i];
+            }
+            delete[] deferred;
+            deferred = grown;
+        }
+        deferred[deferredCount++] = message;
+    }
+};
+
+int numShards = 0;
+MatchingShard* shards = nullptr;
+volatile bool shardsRunning = false;
+
+// Array books take commands by id; an order that is no longer live there
+// is left alone, as on the skip lists.
+void applyArrayCommand(OrderBook& book, const ShardMessage& message, MatchStats& stats) {
+    OrderType side = BUY;
+    if (message.command == SHARD_CANCEL) {
+        book.cancelArrayOrder(message.targetId, side);
+    } else if (message.command == SHARD_REDUCE) {
+        book.reduceArrayOrder(message.targetId, message.quantity);
+    } else if (book.cancelArrayOrder(message.targetId, side) > 0) {
+        book.matchOrder(Order(side, tickers[message.bookIndex], message.quantity, message.priceTicks, message.newId),
+                        stats);
+    } else {
+        orderIndex.erase(message.newId);
+    }
+}
+
+// A command for an order that is still pending was sent by another thread
+// and overtook the order's entry; it waits in the shard's deferred queue.
+void applyShardCommand(MatchingShard& shard, const ShardMessage& message, MatchStats& stats) {
+    OrderBook& book = bookAt(message.bookIndex);
+    if (message.command == SHARD_ADD) {
+        book.matchOrder(message.order, stats);
+        return;
+    }
+    if (orderIndex.findPending(message.targetId) >= 0) {
+        shard.defer(message);
+        return;
+    }
+    if (book.isArrayBook()) {
+        applyArrayCommand(book, message, stats);
+        return;
+    }
+    OrderNode* node = orderIndex.find(message.targetId);
+    if (!node) {
+        if (message.command == SHARD_REPLACE) {
+            orderIndex.erase(message.newId);
+        }
+        return;
+    }
+    if (message.command == SHARD_CANCEL) {
+        book.cancelOrder(node);
+    } else if (message.command == SHARD_REDUCE) {
+        book.reduceOrder(node, message.quantity);
+    } else if (book.cancelOrder(node) > 0) {
+        book.matchOrder(Order(node->order.orderType, node->order.ticker, message.quantity, message.priceTicks,
+                              message.newId), stats);
+    } else {
+        orderIndex.erase(message.newId);
+    }
+}
+
+// Retries the deferred commands in arrival order; those whose order is
+// still pending stay queued.
+void retryDeferred(MatchingShard& shard, MatchStats& stats) {
+    int count = shard.deferredCount;
+    shard.deferredCount = 0;
+    for (int i = 0; i < count; i++) {
+        ShardMessage message = shard.deferred[i];
+        if (orderIndex.findPending(message.targetId) >= 0) {
+            shard.deferred[shard.deferredCount++] = message;
+        } else {
+            applyShardCommand(shard, message, stats);
+        }
+    }
+}
+
+void shardFunction(int shardId) {
+    if (numaEnabled) {
+        enterNumaNode(shardId % numaNodeCount);
+    }
+    pinEngineThread(shardId);
+    MatchingShard& shard = shards[shardId];
+    ShardMessage* batch = new ShardMessage[SHARD_BATCH];
+    int idleSpins = 0;
+    while (true) {
+        int count = 0;
+        while (count < SHARD_BATCH && shard.ring.tryPop(batch[count])) {
+            count++;
+        }
+        if (count > 0) {
+            EpochGuard guard;
+            MatchStats& stats = currentMatchStats();
+            for (int i = 0; i < count; i++) {
+                applyShardCommand(shard, batch[i], stats);
+            }
+            if (shard.deferredCount > 0) {
+                retryDeferred(shard, stats);
+            }
+            idleSpins = 0;
+        } else if (shard.deferredCount > 0) {
+            EpochGuard guard;
+            retryDeferred(shard, currentMatchStats());
+            engineIdleWait(idleSpins);
+        } else if (!shardsRunning) {
+            break;
+        } else {
+            engineIdleWait(idleSpins);
+        }
+    }
+    delete[] batch;
+}
+
+void startShards(int count) {
+    numShards = count;
+    shardsRunning = true;
+    shards = newAlignedArray<MatchingShard>(count);
+    for (int i = 0; i < count; i++) {
+        shards[i].thread = std::thread(shardFunction, i);
+    }
+}
+
+// Producers must have stopped; each shard drains its ring before exiting.
+void stopShards() {
+    if (numShards == 0) {
+        return;
+    }
+    __atomic_store_n(&shardsRunning, false, __ATOMIC_RELEASE);
+    for (int i = 0; i < numShards; i++) {
+        shards[i].thread.join();
+    }
+    deleteAlignedArray(shards, numShards);
+    shards = nullptr;
+    numShards = 0;
+}
+
+void pushToShard(const ShardMessage& message) {
+    MpscRing<ShardMessage>& ring = shards[message.bookIndex % numShards].ring;
+    while (!ring.tryPush(message)) {
+        std::this_thread::yield();
+    }
+}
+
+// Enters the order as pending before queueing it, so a cancel can route to it.
+void submitToShard(int bookIndex, const Order& order) {
+    {
+        EpochGuard guard;
+        orderIndex.insertPending(order.orderId, bookIndex);
+    }
+    pushToShard(ShardMessage(order, bookIndex));
+}
+
+// Prices are converted to integer ticks of the ticker's book here and stay in
+// ticks until a trade is reported. Returns the new order's id, or 0 when the
+// order is rejected: unknown ticker, non-positive quantity, or a price that is
+// not a positive tick count in int range.
+uint64_t addOrder(OrderType orderType, const TickerString& ticker, int quantity, double price) {
+    StageTimer routeTimer(STAGE_ROUTE);
+    int idx = getOrderBookIndex(ticker);
+    routeTimer.stop();
+    if (idx < 0 || quantity <= 0) {
+        return 0;
+    }
+    OrderBook& book = bookAt(idx);
+    int priceTicks;
+    if (!book.toTicks(price, priceTicks)) {
+        return 0;
+    }
+    StageTimer createTimer(STAGE_CREATE);
+    uint64_t orderId = nextOrderId();
+    Order order(orderType, ticker, quantity, priceTicks, orderId);
+    createTimer.stop();
+    if (numShards > 0) {
+        submitToShard(idx, order);
+    } else {
+        book.addOrder(order);
+    }
+    return orderId;
+}
+
+// Without shards, cancels and amendments run directly on the lock-free book
+// from the calling thread. With shards they are queued to the book's shard
+// behind the order's own entry and applied there asynchronously: cancelOrder
+// then reports whether the order was still open or queued, and modifyOrder
+// returns the id that will carry the quantity if the order is still open
+// when the shard gets to it.
+bool cancelOrder(uint64_t orderId) {
+    if (orderId == 0) {
+        return false;
+    }
+    EpochGuard guard;
+    OrderNode* node = orderIndex.find(orderId);
+    if (numShards > 0) {
+        int bookIndex = node ? getOrderBookIndex(node->order.ticker) : orderIndex.findNodelessBook(orderId);
+        if (bookIndex < 0 || (node && node->order.availableQuantity() == 0)) {
+            return false;
+        }
+        pushToShard(ShardMessage(SHARD_CANCEL, bookIndex, orderId));
+        return true;
+    }
+    if (!node) {
+        return false;
+    }
+    return bookAt(getOrderBookIndex(node->order.ticker)).cancelOrder(node) > 0;
+}
+
+uint64_t modifyShardedOrder(uint64_t orderId, OrderNode* node, int newQuantity, double newPrice) {
+    int bookIndex = node ? getOrderBookIndex(node->order.ticker) : orderIndex.findNodelessBook(orderId);
+    if (bookIndex < 0) {
+        return 0;
+    }
+    int priceTicks;
+    if (!bookAt(bookIndex).toTicks(newPrice, priceTicks)) {
+        return 0;
+    }
+    if (node && node->order.priceTicks == priceTicks && node->order.availableQuantity() >= newQuantity) {
+        ShardMessage message(SHARD_REDUCE, bookIndex, orderId);
+        message.quantity = newQuantity;
+        pushToShard(message);
+        return orderId;
+    }
+    ShardMessage message(SHARD_REPLACE, bookIndex, orderId);
+    message.newId = nextOrderId();
+    message.quantity = newQuantity;
+    message.priceTicks = priceTicks;
+    orderIndex.insertPending(message.newId, bookIndex);
+    pushToShard(message);
+    return message.newId;
+}
+
+// Lowering the quantity at the same price keeps the order's queue position
+// and its id. Any other change cancels the remaining quantity and enters a
+// new order at the back of the queue. Returns the id now carrying the
+// quantity, or 0 when the order is no longer open. An invalid price is
+// rejected with 0 and leaves the order untouched.
+uint64_t modifyOrder(uint64_t orderId, int newQuantity, double newPrice) {
+    if (orderId == 0 || newQuantity <= 0) {
+        cancelOrder(orderId);
+        return 0;
+    }
+    EpochGuard guard;
+    OrderNode* node = orderIndex.find(orderId);
+    if (numShards > 0) {
+        return modifyShardedOrder(orderId, node, newQuantity, newPrice);
+    }
+    if (!node) {
+        return 0;
+    }
+    OrderBook& book = bookAt(getOrderBookIndex(node->order.ticker));
+    int priceTicks;
+    if (!book.toTicks(newPrice, priceTicks)) {
+        return 0;
+    }
+    if (priceTicks == node->order.priceTicks && book.reduceOrder(node, newQuantity)) {
+        return orderId;
+    }
+    if (book.cancelOrder(node) == 0) {
+        return 0;
+    }
+    return addOrder(node->order.orderType, node->order.ticker, newQuantity, newPrice);
+}
+
+// Batched submission
+//
+// addOrders takes a packet of requests, hashes all tickers up front
+// (prefetching each book while the next ticker is hashed), sorts the packet
+// by shard and book with the original position as tie-breaker, and then
+// matches each book's run in arrival order under a single epoch guard, or
+// pushes each shard's run onto its ring with one CAS. Requests for unknown
+// tickers, with non-positive quantities or with invalid prices (see addOrder)
+// are rejected with id 0.
+const size_t ORDER_BATCH_CHUNK = 64;
+
+struct OrderRequest {
+    OrderType orderType;
+    TickerString ticker;
+    int quantity;
+    double price;
+};
+
+size_t addOrderChunk(const OrderRequest* batch, size_t count, uint64_t* orderIds) {
+    int books[ORDER_BATCH_CHUNK];
+    int priceTicks[ORDER_BATCH_CHUNK];
+    uint64_t keys[ORDER_BATCH_CHUNK];
+    size_t accepted = 0;
+    for (size_t i = 0; i < count; i++) {
+        StageTimer routeTimer(STAGE_ROUTE);
+        int idx = getOrderBookIndex(batch[i].ticker);
+        routeTimer.stop();
+        OrderBook* book = (idx >= 0 && batch[i].quantity > 0) ? &bookAt(idx) : nullptr;
+        if (!book || !book->toTicks(batch[i].price, priceTicks[i])) {
+            orderIds[i] = 0;
+            continue;
+        }
+        __builtin_prefetch(book);
+        books[i] = idx;
+        StageTimer createTimer(STAGE_CREATE);
+        orderIds[i] = nextOrderId();
+        createTimer.stop();
+        int group = (numShards > 0) ? idx % numShards : 0;
+        uint64_t key = (((uint64_t)group * numBooks + idx) << 8) | i;
+        size_t pos = accepted++;
+        while (pos > 0 && keys[pos - 1] > key) {
+            keys[pos] = keys[pos - 1];
+            pos--;
+        }
+        keys[pos] = key;
+    }
+
+    if (numShards == 0) {
+        EpochGuard guard;
+        MatchStats& stats = currentMatchStats();
+        for (size_t k = 0; k < accepted; k++) {
+            size_t i = keys[k] & 0xFF;
+            OrderBook& book = bookAt(books[i]);
+            book.matchOrder(Order(batch[i].orderType, batch[i].ticker, batch[i].quantity, priceTicks[i], orderIds[i]),
+                            stats);
+        }
+        return accepted;
+    }
+
+    ShardMessage messages[ORDER_BATCH_CHUNK];
+    {
+        EpochGuard guard;
+        for (size_t k = 0; k < accepted; k++) {
+            size_t i = keys[k] & 0xFF;
+            messages[k] = ShardMessage(Order(batch[i].orderType, batch[i].ticker, batch[i].quantity, priceTicks[i],
+                                             orderIds[i]), books[i]);
+            orderIndex.insertPending(orderIds[i], books[i]);
+        }
+    }
+    size_t start = 0;
+    while (start < accepted) {
+        int shard = messages[start].bookIndex % numShards;
+        size_t end = start + 1;
+        while (end < accepted && messages[end].bookIndex % numShards == shard) {
+            end++;
+        }
+        while (start < end) {
+            size_t pushed = shards[shard].ring.tryPushBatch(messages + start, end - start);
+            if (pushed == 0) {
+                std::this_thread::yield();
+            }
+            start += pushed;
+        }
+    }
+    return accepted;
+}
+
+// Returns how many requests were accepted. When orderIds is given, it receives
+// each request's order id, or 0 for a rejected request.
+size_t addOrders(const OrderRequest* batch, size_t count, uint64_t* orderIds = nullptr) {
+    uint64_t chunkIds[ORDER_BATCH_CHUNK];
+    size_t accepted = 0;
+    for (size_t base = 0; base < count; base += ORDER_BATCH_CHUNK) {
+        size_t chunk = (count - base < ORDER_BATCH_CHUNK) ? count - base : ORDER_BATCH_CHUNK;
+        uint64_t* ids = orderIds ? orderIds + base : chunkIds;
+        accepted += addOrderChunk(batch + base, chunk, ids);
+    }
+    return accepted;
+}
+
+struct Quote {
+    double price;
+    int quantity;
+};
+
+// Best bid and ask of a ticker, one atomic load per side; no lock, guard or
+// list walk. A side with nothing resting has quantity 0. Quotes never create
+// a book.
+bool getTopOfBook(const TickerString& ticker, Quote& bid, Quote& ask) {
+    int idx = getOrderBookIndex(ticker);
+    if (idx < 0) {
+        return false;
+    }
+    const OrderBook* existing = findBook(idx);
+    if (!existing) {
+        bid.price = ask.price = 0;
+        bid.quantity = ask.quantity = 0;
+        return true;
+    }
+    const OrderBook& book = *existing;
+    uint64_t bestBid = book.topOf(BUY);
+    uint64_t bestAsk = book.topOf(SELL);
+    bid.price = book.toPrice(topPriceOf(bestBid));
+    bid.quantity = topQuantityOf(bestBid);
+    ask.price = book.toPrice(topPriceOf(bestAsk));
+    ask.quantity = topQuantityOf(bestAsk);
+    return true;
+}
+
+bool setTickSize(const TickerString& ticker, double tickSize) {
+    int idx = getOrderBookIndex(ticker);
+    if (idx < 0) {
+        return false;
+    }
+    bookAt(idx).setTickSize(tickSize);
+    return true;
+}
+
+// Puts the ticker's book on the array representation. Like setTickSize it
+// must come before the book's first order, and only sharded matching keeps
+// the book single-writer once orders flow.
+bool useArrayBook(const TickerString& ticker) {
+    int idx = getOrderBookIndex(ticker);
+    if (idx < 0) {
+        return false;
+    }
+    bookAt(idx).useArrayBook();
+    return true;
+}
+
+// Trade writer thread
+enum TradeSinkMode { TRADES_TEXT, TRADES_BINARY, TRADES_DISCARD };
+
+const unsigned int TRADE_LOG_MAGIC = 0x32445254; // "TRD2", 64-bit order ids
+
+TradeSinkMode tradeSinkMode = TRADES_TEXT;
+FILE* tradeLog = nullptr;
+std::thread tradeWriterThread;
+unsigned long tradesWritten = 0;
+unsigned long tradesDropped = 0;
+
+void writeTrade(const TradeRecord& trade) {
+    tradesWritten++;
+    if (tradeSinkMode == TRADES_TEXT) {
+        const OrderBook& book = *findBook(trade.bookIndex);
+        printf("Trade executed for ticker %s: %d shares at %.*f\n",
+               trade.ticker.c_str(), trade.quantity, book.getPriceDecimals(), book.toPrice(trade.priceTicks));
+    } else if (tradeSinkMode == TRADES_BINARY) {
+        fwrite(&trade, sizeof(trade), 1, tradeLog);
+    }
+}
+
+void tradeWriterFunction() {
+    int idleSpins = 0;
+    while (true) {
+        bool running = tradeChannels.isOpen();
+        if (tradeChannels.drain(writeTrade) > 0) {
+            idleSpins = 0;
+        } else if (!running) {
+            break;
+        } else if (++idleSpins > 64) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Binary logs start with the magic and the record size, followed by raw
+// TradeRecords.
+bool startTradeSink(TradeSinkMode mode, const char* path = nullptr) {
+    tradeSinkMode = mode;
+    tradesWritten = 0;
+    tradesDropped = 0;
+    if (mode == TRADES_BINARY) {
+        tradeLog = fopen(path, "wb");
+        if (!tradeLog) {
+            fprintf(stderr, "Cannot open trade log %s\n", path);
+            return false;
+        }
+        unsigned int header[2] = { TRADE_LOG_MAGIC, (unsigned int)sizeof(TradeRecord) };
+        fwrite(header, sizeof(header), 1, tradeLog);
+    }
+    tradeChannels.open();
+    tradeWriterThread = std::thread(tradeWriterFunction);
+    return true;
+}
+
+// Producers must have stopped; the writer drains every channel before exiting.
+void stopTradeSink() {
+    if (!tradeChannels.isOpen()) {
+        return;
+    }
+    tradeChannels.close();
+    tradeWriterThread.join();
+    unsigned long dropped = tradeChannels.release();
+    if (tradeLog) {
+        fclose(tradeLog);
+        tradeLog = nullptr;
+    }
+    tradesDropped = dropped;
+    if (dropped > 0) {
+        fprintf(stderr, "Trade sink dropped %lu records\n", dropped);
+    }
+}
+
+// Market data
+//
+// The market-data writer keeps a shadow of the levels of every book that has
+// seen a delta, built only from the published level deltas, and turns it
+// into a binary L2 stream. Shadows are allocated on a book's first delta, so
+// a large ticker universe costs one pointer per untouched book.
+// After each drain round it emits one ADD, CHANGE or DELETE per level that
+// changed, numbered by a per-book sequence, so updates within a round are
+// conflated. A level whose shadow quantity is negative is still missing a
+// delta from another thread's ring and waits for a later round. Every
+// snapshot interval each active book is written in full: a SNAPSHOT record
+// with the book's current sequence and level count, followed by its levels
+// best price first. A consumer starts from a snapshot and applies the updates
+// with a higher sequence.
+enum MarketDataAction { MD_ADD, MD_CHANGE, MD_DELETE, MD_SNAPSHOT, MD_SNAPSHOT_LEVEL };
+
+const unsigned int MARKET_DATA_MAGIC = 0x3153444D; // "MDS1"
+
+struct MarketDataRecord {
+    uint64_t sequence;
+    int bookIndex;
+    int priceTicks;
+    int quantity;
+    unsigned char side;   // OrderType
+    unsigned char action; // MarketDataAction
+    unsigned char padding[2];
+};
+
+static_assert(sizeof(MarketDataRecord) == 24, "market-data records have no implicit padding");
+
+struct ShadowLevel {
+    int priceTicks;
+    int64_t quantity;
+    int64_t publishedQuantity;
+    bool dirty;
+    bool used;
+};
+
+// One side of a shadow book: open addressing on the price with backward-shift
+// deletion. Only the market-data writer touches it.
+class ShadowSide {
+private:
+    ShadowLevel* slots;
+    int mask;
+    int count;
+
+    int home(int priceTicks) const { return (int)(((uint32_t)priceTicks * 0x9E3779B1u) >> 8) & mask; }
+
+    void grow() {
+        ShadowLevel* old = slots;
+        int oldCapacity = slots ? mask + 1 : 0;
+        int capacity = oldCapacity ? oldCapacity * 2 : 64;
+        slots = static_cast<ShadowLevel*>(calloc(capacity, sizeof(ShadowLevel)));
+        mask = capacity - 1;
+        for (int i = 0; i < oldCapacity; i++) {
+            if (old[i].used) {
+                int slot = home(old[i].priceTicks);
+                while (slots[slot].used) {
+                    slot = (slot + 1) & mask;
+                }
+                slots[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+
+public:
+    ShadowSide() : slots(nullptr), mask(0), count(0) {}
+    ~ShadowSide() { free(slots); }
+
+    int size() const { return count; }
+    int capacity() const { return slots ? mask + 1 : 0; }
+    const ShadowLevel& at(int slot) const { return slots[slot]; }
+
+    ShadowLevel* find(int priceTicks) {
+        if (!slots) {
+            return nullptr;
+        }
+        for (int slot = home(priceTicks); slots[slot].used; slot = (slot + 1) & mask) {
+            if (slots[slot].priceTicks == priceTicks) {
+                return &slots[slot];
+            }
+        }
+        return nullptr;
+    }
+
+    ShadowLevel* findOrInsert(int priceTicks) {
+        ShadowLevel* level = find(priceTicks);
+        if (level) {
+            return level;
+        }
+        if (!slots || (count + 1) * 2 > mask + 1) {
+            grow();
+        }
+        int slot = home(priceTicks);
+        while (slots[slot].used) {
+            slot = (slot + 1) & mask;
+        }
+        ShadowLevel init = { priceTicks, 0, 0, false, true };
+        slots[slot] = init;
+        count++;
+        return &slots[slot];
+    }
+
+    void remove(ShadowLevel* level) {
+        int hole = (int)(level - slots);
+        slots[hole].used = false;
+        count--;
+        for (int slot = (hole + 1) & mask; slots[slot].used; slot = (slot + 1) & mask) {
+            int want = home(slots[slot].priceTicks);
+            // Move the entry back unless its home lies cyclically in (hole, slot].
+            if (((slot - want) & mask) >= ((slot - hole) & mask)) {
+                slots[hole] = slots[slot];
+                slots[slot].used = false;
+                hole = slot;
+            }
+        }
+    }
+};
+
+// The writer's view of one book, allocated the first time a delta names it.
+struct ShadowBook {
+    ShadowSide sides[2]; // indexed by OrderType
+    uint64_t sequence;
+
+    ShadowBook() : sequence(0) {}
+};
+
+struct DirtyLevel {
+    int bookIndex;
+    int priceTicks;
+    OrderType side;
+};
+
+FILE* marketDataLog = nullptr;
+std::thread marketDataThread;
+ShadowBook** shadowBooks = nullptr; // one pointer per book, null until the book is touched
+int* activeBooks = nullptr;         // touched books, in the order they were first touched
+int activeBookCount = 0;
+int activeBookCapacity = 0;
+DirtyLevel* dirtyLevels = nullptr;
+size_t dirtyCount = 0;
+size_t dirtyCapacity = 0;
+uint64_t snapshotIntervalNanos = 0;
+unsigned long marketDataUpdates = 0;
+
+ShadowBook& shadowBook(int bookIndex) {
+    ShadowBook* book = shadowBooks[bookIndex];
+    if (!book) {
+        book = new ShadowBook();
+        shadowBooks[bookIndex] = book;
+        if (activeBookCount == activeBookCapacity) {
+            activeBookCapacity = activeBookCapacity ? activeBookCapacity * 2 : 64;
+            activeBooks = static_cast<int*>(realloc(activeBooks, activeBookCapacity * sizeof(int)));
+        }
+        activeBooks[activeBookCount++] = bookIndex;
+    }
+    return *book;
+}
+
+// Level quantities above INT_MAX are written as INT_MAX, as in quotes.
+void writeMarketData(int bookIndex, OrderType side, int priceTicks, int64_t quantity, MarketDataAction action) {
+    MarketDataRecord record = MarketDataRecord();
+    record.sequence = shadowBooks[bookIndex]->sequence;
+    record.bookIndex = bookIndex;
+    record.priceTicks = priceTicks;
+    record.quantity = saturateQuantity(quantity);
+    record.side = (unsigned char)side;
+    record.action = (unsigned char)action;
+    fwrite(&record, sizeof(record), 1, marketDataLog);
+}
+
+void applyLevelDelta(const LevelDelta& delta) {
+    ShadowLevel* level = shadowBook(delta.bookIndex).sides[delta.side].findOrInsert(delta.priceTicks);
+    level->quantity += delta.delta;
+    if (!level->dirty) {
+        level->dirty = true;
+        if (dirtyCount == dirtyCapacity) {
+            dirtyCapacity = dirtyCapacity ? dirtyCapacity * 2 : 1024;
+            dirtyLevels = static_cast<DirtyLevel*>(realloc(dirtyLevels, dirtyCapacity * sizeof(DirtyLevel)));
+        }
+        DirtyLevel dirty = { delta.bookIndex, delta.priceTicks, delta.side };
+        dirtyLevels[dirtyCount++] = dirty;
+    }
+}
+
+// Emits one update per changed level and keeps levels that are still
+// negative for the next round.
+void flushDirtyLevels() {
+    size_t kept = 0;
+    for (size_t i = 0; i < dirtyCount; i++) {
+        DirtyLevel dirty = dirtyLevels[i];
+        ShadowBook& book = *shadowBooks[dirty.bookIndex];
+        ShadowSide& side = book.sides[dirty.side];
+        ShadowLevel* level = side.find(dirty.priceTicks);
+        if (level->quantity < 0) {
+            dirtyLevels[kept++] = dirty;
+            continue;
+        }
+        level->dirty = false;
+        if (level->quantity != level->publishedQuantity) {
+            MarketDataAction action = (level->publishedQuantity == 0) ? MD_ADD
+                                    : (level->quantity == 0) ? MD_DELETE : MD_CHANGE;
+            book.sequence++;
+            writeMarketData(dirty.bookIndex, dirty.side, dirty.priceTicks, level->quantity, action);
+            marketDataUpdates++;
+            level->publishedQuantity = level->quantity;
+        }
+        if (level->quantity == 0) {
+            side.remove(level);
+        }
+    }
+    dirtyCount = kept;
+}
+
+int compareLevelsAscending(const void* a, const void* b) {
+    return static_cast<const ShadowLevel*>(a)->priceTicks - static_cast<const ShadowLevel*>(b)->priceTicks;
+}
+
+int compareLevelsDescending(const void* a, const void* b) {
+    return compareLevelsAscending(b, a);
+}
+
+// Collects the published levels of one side into levels, best price first.
+int collectSnapshotSide(const ShadowSide& shadow, OrderType side, ShadowLevel* levels) {
+    int count = 0;
+    for (int slot = 0; slot < shadow.capacity(); slot++) {
+        if (shadow.at(slot).used && shadow.at(slot).publishedQuantity > 0) {
+            levels[count++] = shadow.at(slot);
+        }
+    }
+    qsort(levels, count, sizeof(ShadowLevel), side == BUY ? compareLevelsDescending : compareLevelsAscending);
+    return count;
+}
+
+void writeSnapshot() {
+    ShadowLevel* levels = nullptr;
+    int levelCapacity = 0;
+    for (int i = 0; i < activeBookCount; i++) {
+        int book = activeBooks[i];
+        if (shadowBooks[book]->sequence == 0) {
+            continue;
+        }
+        const ShadowSide& bids = shadowBooks[book]->sides[BUY];
+        const ShadowSide& asks = shadowBooks[book]->sides[SELL];
+        if (bids.size() + asks.size() > levelCapacity) {
+            levelCapacity = (bids.size() + asks.size()) * 2;
+            levels = static_cast<ShadowLevel*>(realloc(levels, levelCapacity * sizeof(ShadowLevel)));
+        }
+        int bidCount = collectSnapshotSide(bids, BUY, levels);
+        int askCount = collectSnapshotSide(asks, SELL, levels + bidCount);
+        writeMarketData(book, BUY, 0, bidCount + askCount, MD_SNAPSHOT);
+        for (int i = 0; i < bidCount + askCount; i++) {
+            writeMarketData(book, i < bidCount ? BUY : SELL, levels[i].priceTicks, levels[i].publishedQuantity,
+                            MD_SNAPSHOT_LEVEL);
+        }
+    }
+    free(levels);
+    fflush(marketDataLog);
+}
+
+void marketDataWriterFunction() {
+    uint64_t nextSnapshot = nowNanos() + snapshotIntervalNanos;
+    int idleSpins = 0;
+    while (true) {
+        bool running = levelDeltaChannels.isOpen();
+        int drained = levelDeltaChannels.drain(applyLevelDelta);
+        if (drained > 0 || dirtyCount > 0) {
+            flushDirtyLevels();
+        }
+        if (snapshotIntervalNanos > 0 && nowNanos() >= nextSnapshot) {
+            writeSnapshot();
+            nextSnapshot = nowNanos() + snapshotIntervalNanos;
+        }
+        if (drained > 0) {
+            idleSpins = 0;
+        } else if (!running) {
+            break;
+        } else if (++idleSpins > 64) {
+            std::this_thread::yield();
+        }
+    }
+    writeSnapshot();
+}
+
+// Streams start with the magic and the record size, followed by raw
+// MarketDataRecords. A snapshot interval of 0 only writes the final snapshot.
+bool startMarketData(const char* path, int snapshotMillis) {
+    marketDataLog = fopen(path, "wb");
+    if (!marketDataLog) {
+        fprintf(stderr, "Cannot open market data stream %s\n", path);
+        return false;
+    }
+    unsigned int header[2] = { MARKET_DATA_MAGIC, (unsigned int)sizeof(MarketDataRecord) };
+    fwrite(header, sizeof(header), 1, marketDataLog);
+    shadowBooks = static_cast<ShadowBook**>(calloc(numBooks, sizeof(ShadowBook*)));
+    snapshotIntervalNanos = (uint64_t)snapshotMillis * 1000000;
+    marketDataUpdates = 0;
+    levelDeltaChannels.open();
+    marketDataThread = std::thread(marketDataWriterFunction);
+    return true;
+}
+
+// Producers must have stopped; the writer applies every delta and writes a
+// final snapshot before exiting.
+void stopMarketData() {
+    if (!levelDeltaChannels.isOpen()) {
+        return;
+    }
+    levelDeltaChannels.close();
+    marketDataThread.join();
+    levelDeltaChannels.release();
+    fclose(marketDataLog);
+    marketDataLog = nullptr;
+    for (int i = 0; i < activeBookCount; i++) {
+        delete shadowBooks[activeBooks[i]];
+    }
+    free(shadowBooks);
+    shadowBooks = nullptr;
+    free(activeBooks);
+    activeBooks = nullptr;
+    activeBookCount = activeBookCapacity = 0;
+    free(dirtyLevels);
+    dirtyLevels = nullptr;
+    dirtyCount = dirtyCapacity = 0;
+}
+
+TickerString generateTickerSymbol(int index) {
+    char buffer[MAX_TICKER_LENGTH];
+    snprintf(buffer, MAX_TICKER_LENGTH, "TICKER%d", index);
+    return TickerString(buffer);
+}
+
+TickerString* tickers = nullptr;
+
+// Generates the ticker universe, one symbol per book, and builds its perfect
+// hash; tickers is the dense symbol table and ticker i owns book i. Call
+// after initOrderBooks.
+bool initTickers() {
+    tickers = new TickerString[numBooks];
+    for (int i = 0; i < numBooks; i++) {
+        tickers[i] = generateTickerSymbol(i);
+    }
+    if (!tickerIndex.build(tickers, numBooks)) {
+        fprintf(stderr, "Cannot build a perfect hash for the ticker universe\n");
+        return false;
+    }
+    return true;
+}
+
+void cleanupTickers() {
+    delete[] tickers;
+}
+
+// Journal
+//
+// An append-only, memory-mapped write-ahead journal of the JournalRecords.
+// One writer thread drains the channels, gives each record the next journal
+// sequence, copies it into the mapping and ends every drain round with a
+// single msync over the pages it wrote, so all records that arrived while the
+// previous flush ran share the next one (group commit). Matching threads never
+// touch the file. journalDurableSequence is the highest sequence known to be
+// on disk. The file is a 64-byte header followed by records and grows by
+// whole segments; unused space is zero and a record with sequence 0 marks the
+// end.
+const unsigned int JOURNAL_MAGIC = 0x314C4E4A; // "JNL1"
+const size_t JOURNAL_HEADER_SIZE = 64;
+const size_t JOURNAL_SEGMENT_SIZE = 16 << 20;
+
+int journalFd = -1;
+char* journalMap = nullptr;
+size_t journalMapped = 0;
+size_t journalEnd = 0;
+size_t journalSyncedEnd = 0;
+uint64_t journalSequence = 0;
+volatile uint64_t journalDurableSequence = 0;
+unsigned long journalAppended = 0;
+unsigned long journalCommits = 0;
+unsigned long journalLost = 0;
+std::thread journalThread;
+
+// Grows the file to size and maps all of it. The old mapping stays when the
+// file cannot grow.
+bool mapJournal(size_t size) {
+    if (ftruncate(journalFd, size) != 0) {
+        return false;
+    }
+    if (journalMap) {
+        munmap(journalMap, journalMapped);
+        journalMap = nullptr;
+    }
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, journalFd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    journalMap = static_cast<char*>(map);
+    journalMapped = size;
+    return true;
+}
+
+void commitJournal() {
+    if (journalEnd == journalSyncedEnd) {
+        return;
+    }
+    size_t pageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    size_t from = journalSyncedEnd & ~pageMask;
+    msync(journalMap + from, journalEnd - from, MS_SYNC);
+    journalSyncedEnd = journalEnd;
+    journalCommits++;
+    __atomic_store_n(&journalDurableSequence, journalSequence, __ATOMIC_RELEASE);
+}
+
+void appendJournal(const JournalRecord& record) {
+    if (journalEnd + sizeof(JournalRecord) > journalMapped || !journalMap) {
+        commitJournal();
+        if (!mapJournal(journalMapped + JOURNAL_SEGMENT_SIZE)) {
+            journalLost++;
+            return;
+        }
+    }
+    JournalRecord* slot = reinterpret_cast<JournalRecord*>(journalMap + journalEnd);
+    *slot = record;
+    slot->sequence = ++journalSequence;
+    journalEnd += sizeof(JournalRecord);
+    journalAppended++;
+}
+
+void journalWriterFunction() {
+    int idleSpins = 0;
+    while (true) {
+        bool running = journalChannels.isOpen();
+        if (journalChannels.drain(appendJournal) > 0) {
+            commitJournal();
+            idleSpins = 0;
+        } else if (!running) {
+            break;
+        } else if (++idleSpins > 64) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool validJournalHeader(const char* data, size_t size) {
+    if (size < JOURNAL_HEADER_SIZE) {
+        return false;
+    }
+    unsigned int header[2];
+    memcpy(header, data, sizeof(header));
+    return header[0] == JOURNAL_MAGIC && header[1] == sizeof(JournalRecord);
+}
+
+// Offset just past the last record of a mapped journal.
+size_t findJournalEnd(const char* data, size_t size, uint64_t* lastSequence) {
+    size_t offset = JOURNAL_HEADER_SIZE;
+    *lastSequence = 0;
+    while (offset + sizeof(JournalRecord) <= size) {
+        const JournalRecord* record = reinterpret_cast<const JournalRecord*>(data + offset);
+        if (record->sequence == 0) {
+            break;
+        }
+        *lastSequence = record->sequence;
+        offset += sizeof(JournalRecord);
+    }
+    return offset;
+}
+
+// Opens or creates the journal and appends after its last record; replay an
+// existing journal first so the books agree with it.
+bool startJournal(const char* path) {
+    journalFd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (journalFd < 0 || fstat(journalFd, &info) != 0) {
+        fprintf(stderr, "Cannot open journal %s\n", path);
+        if (journalFd >= 0) {
+            close(journalFd);
+            journalFd = -1;
+        }
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    size_t segments = size > JOURNAL_HEADER_SIZE ? (size - JOURNAL_HEADER_SIZE) / JOURNAL_SEGMENT_SIZE + 1 : 1;
+    if (!mapJournal(JOURNAL_HEADER_SIZE + segments * JOURNAL_SEGMENT_SIZE)) {
+        fprintf(stderr, "Cannot map journal %s\n", path);
+        close(journalFd);
+        journalFd = -1;
+        return false;
+    }
+    if (size == 0) {
+        unsigned int header[2] = { JOURNAL_MAGIC, (unsigned int)sizeof(JournalRecord) };
+        memcpy(journalMap, header, sizeof(header));
+    } else if (!validJournalHeader(journalMap, size)) {
+        fprintf(stderr, "%s is not a journal\n", path);
+        munmap(journalMap, journalMapped);
+        journalMap = nullptr;
+        ftruncate(journalFd, size);
+        close(journalFd);
+        journalFd = -1;
+        return false;
+    }
+    journalEnd = findJournalEnd(journalMap, journalMapped, &journalSequence);
+    journalSyncedEnd = size == 0 ? 0 : journalEnd;
+    journalDurableSequence = journalSequence;
+    journalAppended = 0;
+    journalCommits = 0;
+    journalLost = 0;
+    journalChannels.open();
+    journalThread = std::thread(journalWriterFunction);
+    return true;
+}
+
+// Producers must have stopped; the writer appends and commits every record
+// before exiting. The file is trimmed to its last record.
+void stopJournal() {
+    if (!journalChannels.isOpen()) {
+        return;
+    }
+    journalChannels.close();
+    journalThread.join();
+    journalChannels.release();
+    commitJournal();
+    if (journalMap) {
+        munmap(journalMap, journalMapped);
+        journalMap = nullptr;
+    }
+    ftruncate(journalFd, journalEnd);
+    fsync(journalFd);
+    close(journalFd);
+    journalFd = -1;
+    journalMapped = journalEnd = journalSyncedEnd = 0;
+    if (journalLost > 0) {
+        fprintf(stderr, "Journal could not grow and lost %lu records\n", journalLost);
+    }
+}
+
+// Remaining quantity per journaled order, by id; used only during replay.
+struct ReplayedOrder {
+    uint64_t orderId;
+    int remaining;
+};
+
+ReplayedOrder* findReplayedOrder(ReplayedOrder* table, size_t mask, uint64_t orderId) {
+    for (size_t slot = (size_t)((orderId * 0x9E3779B97F4A7C15ULL) >> 20) & mask;; slot = (slot + 1) & mask) {
+        if (table[slot].orderId == orderId || table[slot].orderId == 0) {
+            return &table[slot];
+        }
+    }
+}
+
+// Orders ORDER records by book, side and price, then by queue position
+// within the level. Journals written before positions were recorded carry 0
+// throughout and keep journal order.
+int compareReplayOrder(const void* left, const void* right) {
+    const JournalRecord* a = *static_cast<const JournalRecord* const*>(left);
+    const JournalRecord* b = *static_cast<const JournalRecord* const*>(right);
+    if (a->bookIndex != b->bookIndex) {
+        return a->bookIndex < b->bookIndex ? -1 : 1;
+    }
+    if (a->side != b->side) {
+        return a->side < b->side ? -1 : 1;
+    }
+    if (a->priceTicks != b->priceTicks) {
+        return a->priceTicks < b->priceTicks ? -1 : 1;
+    }
+    if (a->queuePosition != b->queuePosition) {
+        return queueBefore(a->queuePosition, b->queuePosition) ? -1 : 1;
+    }
+    return a->sequence < b->sequence ? -1 : (a->sequence > b->sequence ? 1 : 0);
+}
+
+// Takes quantity off an order that is already booked, e.g. restored from a
+// snapshot.
+void reduceBookedOrder(uint64_t orderId, int quantity) {
+    EpochGuard guard;
+    OrderNode* node = orderIndex.find(orderId);
+    if (node) {
+        int left = node->order.availableQuantity() - quantity;
+        bookAt(getOrderBookIndex(node->order.ticker)).reduceOrder(node, left > 0 ? left : 0);
+        return;
+    }
+    int bookIndex = orderIndex.findNodelessBook(orderId);
+    if (bookIndex >= 0 && bookAt(bookIndex).isArrayBook()) {
+        OrderBook& book = bookAt(bookIndex);
+        int left = book.arrayOrderQuantity(orderId) - quantity;
+        book.reduceArrayOrder(orderId, left > 0 ? left : 0);
+    }
+}
+
+// Rebuilds the books from the journal records after afterSequence in two
+// passes: the first indexes every ORDER record by id, the second takes fills
+// and cancellations off the orders they name, or off the booked order when
+// the id predates afterSequence. Each thread's records reach the journal
+// through its own ring, so a fill may come before the order it refers to;
+// fills against an order whose record was lost with the tail are ignored.
+// Orders with quantity left are then booked again under their original ids
+// with restoreOrder, each level in its original queue order. Call after initOrderBooks and initTickers (and
+// restoreBooks, which supplies afterSequence) and before any order is
+// entered or the journal is started. Returns the number of restored orders,
+// 0 when there is no journal, or -1 when the file cannot be read.
+long replayJournal(const char* path, uint64_t afterSequence = 0) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "Cannot replay journal %s\n", path);
+        close(fd);
+        return -1;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)info.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || !validJournalHeader(static_cast<const char*>(map), size)) {
+        fprintf(stderr, "Cannot replay journal %s\n", path);
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        return -1;
+    }
+    const char* data = static_cast<const char*>(map);
+    uint64_t lastSequence;
+    size_t end = findJournalEnd(data, size, &lastSequence);
+    const JournalRecord* records = reinterpret_cast<const JournalRecord*>(data + JOURNAL_HEADER_SIZE);
+    size_t count = (end - JOURNAL_HEADER_SIZE) / sizeof(JournalRecord);
+    // Sequences increase through the file, so the first record to apply is
+    // found by bisection instead of a scan.
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (records[middle].sequence <= afterSequence) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    records += low;
+    count -= low;
+
+    size_t capacity = 1024;
+    while (capacity < count * 2) {
+        capacity <<= 1;
+    }
+    ReplayedOrder* table = static_cast<ReplayedOrder*>(calloc(capacity, sizeof(ReplayedOrder)));
+    uint64_t maxOrderId = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].type == JOURNAL_ORDER) {
+            ReplayedOrder* order = findReplayedOrder(table, capacity - 1, records[i].orderId);
+            order->orderId = records[i].orderId;
+            order->remaining = records[i].quantity;
+            maxOrderId = records[i].orderId > maxOrderId ? records[i].orderId : maxOrderId;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (int party = 0; party < 2; party++) {
+            uint64_t orderId = party == 0 ? records[i].orderId : records[i].otherOrderId;
+            if (records[i].type == JOURNAL_ORDER || (party == 1 && records[i].type != JOURNAL_FILL)) {
+                continue;
+            }
+            ReplayedOrder* order = findReplayedOrder(table, capacity - 1, orderId);
+            if (order->orderId) {
+                order->remaining -= records[i].quantity;
+            } else {
+                reduceBookedOrder(orderId, records[i].quantity);
+            }
+        }
+    }
+
+    // Journal order is not queue order: two orders at one price may reach
+    // the journal in either order, so survivors are sorted on their queue
+    // positions before they are booked again.
+    const JournalRecord** live = static_cast<const JournalRecord**>(malloc((count + 1) * sizeof(JournalRecord*)));
+    size_t liveCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        const JournalRecord& record = records[i];
+        if (record.type != JOURNAL_ORDER || record.bookIndex < 0 || record.bookIndex >= numBooks) {
+            continue;
+        }
+        if (findReplayedOrder(table, capacity - 1, record.orderId)->remaining > 0) {
+            live[liveCount++] = &record;
+        }
+    }
+    qsort(live, liveCount, sizeof(JournalRecord*), compareReplayOrder);
+
+    // The journal already holds the trades these orders made, so they are
+    // booked without matching and without journaling them again.
+    long restored = 0;
+    {
+        EpochGuard guard;
+        for (size_t i = 0; i < liveCount; i++) {
+            const JournalRecord& record = *live[i];
+            int remaining = findReplayedOrder(table, capacity - 1, record.orderId)->remaining;
+            bookAt(record.bookIndex).restoreOrder(Order((OrderType)record.side, tickers[record.bookIndex], remaining,
+                                                        record.priceTicks, record.orderId));
+            restored++;
+        }
+    }
+    reserveOrderIdsThrough(maxOrderId);
+    free(live);
+    free(table);
+    munmap(map, size);
+    return restored;
+}
+
+// Book snapshots
+//
+// snapshotBooks writes the orders resting in every book to a compact file
+// that restoreBooks maps and loads in parallel, one book at a time per
+// worker. The file holds a header with the journal sequence the snapshot
+// covers, a table of record offsets per book and side, and one SnapshotOrder
+// per resting order, best price first and in queue order within a price, so
+// restoring keeps time priority. Replaying the journal after that sequence
+// brings the books up to date. Both must run while no thread is matching,
+// and snapshotBooks while the journal is stopped, so every record up to the
+// sequence is applied and none after it. The snapshot is written under a
+// temporary name and renamed, so a crash never leaves a torn one behind.
+const unsigned int BOOK_SNAPSHOT_MAGIC = 0x314E5342; // "BSN1"
+
+struct BookSnapshotHeader {
+    unsigned int magic;
+    unsigned int recordSize;
+    unsigned int bookCount;
+    unsigned int reserved;
+    uint64_t journalSequence;
+    uint64_t orderCount;
+};
+
+struct SnapshotOrder {
+    uint64_t orderId;
+    int priceTicks;
+    int quantity;
+};
+
+// Record offsets: book b's side s starts at offsets[b * 2 + s] and ends where
+// the next entry starts; offsets[bookCount * 2] is the order count.
+inline size_t snapshotOffsetCount(size_t bookCount) { return bookCount * 2 + 1; }
+
+struct SnapshotWriter {
+    FILE* file;
+    uint64_t written;
+
+    void operator()(const Order& order) {
+        SnapshotOrder record = { order.orderId, order.priceTicks, order.availableQuantity() };
+        fwrite(&record, sizeof(record), 1, file);
+        written++;
+    }
+};
+
+bool snapshotBooks(const char* path) {
+    if (journalChannels.isOpen()) {
+        fprintf(stderr, "Stop the journal before taking a snapshot\n");
+        return false;
+    }
+    char temporaryPath[4096];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
+    FILE* file = fopen(temporaryPath, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot write snapshot %s\n", temporaryPath);
+        return false;
+    }
+    BookSnapshotHeader header = { BOOK_SNAPSHOT_MAGIC, (unsigned int)sizeof(SnapshotOrder), (unsigned int)numBooks,
+                                  0, journalSequence, 0 };
+    size_t offsetCount = snapshotOffsetCount(numBooks);
+    uint64_t* offsets = new uint64_t[offsetCount]();
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(offsets, sizeof(uint64_t), offsetCount, file);
+    SnapshotWriter writer = { file, 0 };
+    {
+        EpochGuard guard;
+        for (int book = 0; book < numBooks; book++) {
+            OrderBook* existing = findBook(book);
+            for (int side = BUY; side <= SELL; side++) {
+                offsets[book * 2 + side] = writer.written;
+                if (existing) {
+                    existing->forEachRestingOrder((OrderType)side, writer);
+                }
+            }
+        }
+    }
+    offsets[numBooks * 2] = header.orderCount = writer.written;
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(offsets, sizeof(uint64_t), offsetCount, file);
+    delete[] offsets;
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporaryPath, path) != 0) {
+        fprintf(stderr, "Cannot write snapshot %s\n", path);
+        remove(temporaryPath);
+        return false;
+    }
+    return true;
+}
+
+struct SnapshotView {
+    int bookCount;
+    const uint64_t* offsets;
+    const SnapshotOrder* orders;
+    volatile int nextBook;
+    volatile long restored;
+};
+
+void restoreBooksWorker(SnapshotView* view) {
+    uint64_t maxOrderId = 0;
+    long restored = 0;
+    int book;
+    while ((book = __sync_fetch_and_add(&view->nextBook, 1)) < view->bookCount) {
+        if (view->offsets[book * 2] == view->offsets[book * 2 + 2]) {
+            continue;
+        }
+        EpochGuard guard;
+        OrderBook& target = bookAt(book);
+        for (int side = BUY; side <= SELL; side++) {
+            for (uint64_t i = view->offsets[book * 2 + side]; i < view->offsets[book * 2 + side + 1]; i++) {
+                const SnapshotOrder& record = view->orders[i];
+                target.restoreOrder(Order((OrderType)side, tickers[book], record.quantity,
+                                                    record.priceTicks, record.orderId));
+                maxOrderId = record.orderId > maxOrderId ? record.orderId : maxOrderId;
+                restored++;
+            }
+        }
+    }
+    reserveOrderIdsThrough(maxOrderId);
+    __sync_fetch_and_add(&view->restored, restored);
+}
+
+// Loads a snapshot into empty books, with one worker per hardware thread
+// claiming books in turn; only books with orders are created. The snapshot
+// may come from a smaller universe, since ticker i always owns book i. Call
+// after initOrderBooks and initTickers.
+// journalSequence receives the sequence to replay the journal from. Returns
+// the number of restored orders, 0 when there is no snapshot, or -1 when the
+// file is not a valid snapshot.
+long restoreBooks(const char* path, uint64_t* journalSequence) {
+    *journalSequence = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    size_t size = fstat(fd, &info) == 0 ? (size_t)info.st_size : 0;
+    void* map = size >= sizeof(BookSnapshotHeader) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const char* data = static_cast<const char*>(map);
+    BookSnapshotHeader header;
+    size_t tableSize = 0;
+    bool valid = map != MAP_FAILED;
+    if (valid) {
+        memcpy(&header, data, sizeof(header));
+        tableSize = sizeof(header) + snapshotOffsetCount(header.bookCount) * sizeof(uint64_t);
+        valid = header.magic == BOOK_SNAPSHOT_MAGIC && header.recordSize == sizeof(SnapshotOrder) &&
+                header.bookCount <= (unsigned int)numBooks && size >= tableSize &&
+                size == tableSize + header.orderCount * sizeof(SnapshotOrder);
+    }
+    if (valid) {
+        const uint64_t* offsets = reinterpret_cast<const uint64_t*>(data + sizeof(header));
+        valid = offsets[header.bookCount * 2] == header.orderCount;
+        for (size_t i = 1; valid && i < snapshotOffsetCount(header.bookCount); i++) {
+            valid = offsets[i - 1] <= offsets[i];
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "Cannot restore snapshot %s\n", path);
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        return -1;
+    }
+
+    SnapshotView view;
+    view.bookCount = (int)header.bookCount;
+    view.offsets = reinterpret_cast<const uint64_t*>(data + sizeof(header));
+    view.orders = reinterpret_cast<const SnapshotOrder*>(data + tableSize);
+    view.nextBook = 0;
+    view.restored = 0;
+    int workers = (int)std::thread::hardware_concurrency();
+    workers = workers < 1 ? 1 : workers;
+    std::thread* threads = new std::thread[workers];
+    for (int i = 0; i < workers; i++) {
+        threads[i] = std::thread(restoreBooksWorker, &view);
+    }
+    for (int i = 0; i < workers; i++) {
+        threads[i].join();
+    }
+    delete[] threads;
+    munmap(map, size);
+    *journalSequence = header.journalSequence;
+    return view.restored;
+}
+
+// Latency histogram
+//
+// HDR-style log-linear histogram: a value is bucketed by its highest set bit
+// plus the HISTOGRAM_SUB_BUCKET_BITS bits below it, so every recorded value is
+// kept within 1% relative error over the full 64-bit range at a fixed size.
+// Each thread records into its own histogram; histograms are merged for
+// reporting.
+const int HISTOGRAM_SUB_BUCKET_BITS = 7;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+const int HISTOGRAM_SIZE = (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+class LatencyHistogram {
+private:
+    unsigned long counts[HISTOGRAM_SIZE];
+    unsigned long total;
+    uint64_t maxValue;
+
+    static int indexFor(uint64_t value) {
+        if (value < (uint64_t)HISTOGRAM_SUB_BUCKETS) {
+            return (int)value;
+        }
+        int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+        return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+    }
+
+    // Highest value that maps to the bucket at index.
+    static uint64_t valueAt(int index) {
+        if (index < HISTOGRAM_SUB_BUCKETS) {
+            return index;
+        }
+        int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t sub = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+        return (sub << shift) + ((uint64_t)1 << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        total = 0;
+        maxValue = 0;
+    }
+
+    void record(uint64_t value) {
+        counts[indexFor(value)]++;
+        total++;
+        if (value > maxValue) maxValue = value;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < HISTOGRAM_SIZE; i++) counts[i] += other.counts[i];
+        total += other.total;
+        if (other.maxValue > maxValue) maxValue = other.maxValue;
+    }
+
+    unsigned long count() const { return total; }
+    uint64_t max() const { return maxValue; }
+
+    uint64_t percentile(double pct) const {
+        if (total == 0) {
+            return 0;
+        }
+        unsigned long target = (unsigned long)ceil(pct / 100.0 * total);
+        if (target == 0) target = 1;
+        unsigned long seen = 0;
+        for (int i = 0; i < HISTOGRAM_SIZE; i++) {
+            seen += counts[i];
+            if (seen >= target) {
+                uint64_t value = valueAt(i);
+                return value < maxValue ? value : maxValue;
+            }
+        }
+        return maxValue;
+    }
+};
+
+// Stage histograms
+//
+// Every thread that records a stage gets its own set of histograms, linked
+// into a global list the first time, so recording never shares a cache
+// line. collectStageHistograms merges them on demand; the counts are only
+// exact once the recording threads have stopped. Values are TSC cycles, which
+// tscNanosPerCycle (measured by enableStageTiming) turns into nanoseconds.
+struct StageHistograms {
+    LatencyHistogram stages[STAGE_COUNT];
+    StageHistograms* next;
+};
+
+StageHistograms* volatile stageHistogramList = nullptr;
+volatile unsigned long stageHistogramGeneration = 0;
+thread_local StageHistograms* localStageHistograms = nullptr;
+thread_local unsigned long localStageGeneration = 0;
+double tscNanosPerCycle = 1.0;
+
+const char* const STAGE_NAMES[STAGE_COUNT] = { "create", "route", "append", "match", "fill" };
+
+void recordStage(LatencyStage stage, uint64_t cycles) {
+    StageHistograms* local = localStageHistograms;
+    if (!local || localStageGeneration != stageHistogramGeneration) {
+        local = newAlignedArray<StageHistograms>(1);
+        StageHistograms* oldHead;
+        do {
+            oldHead = stageHistogramList;
+            local->next = oldHead;
+        } while (!__sync_bool_compare_and_swap(&stageHistogramList, oldHead, local));
+        localStageHistograms = local;
+        localStageGeneration = stageHistogramGeneration;
+    }
+    local->stages[stage].record(cycles);
+}
+
+// Turns stage timing on, after timing the TSC against the monotonic clock
+// for calibrateMillis.
+void enableStageTiming(int calibrateMillis = 20) {
+    uint64_t startNanos = nowNanos();
+    uint64_t startCycles = readTsc();
+    uint64_t elapsed;
+    do {
+        elapsed = nowNanos() - startNanos;
+    } while (elapsed < (uint64_t)calibrateMillis * 1000000);
+    uint64_t cycles = readTsc() - startCycles;
+    tscNanosPerCycle = cycles > 0 ? (double)elapsed / cycles : 1.0;
+    stageTiming = true;
+}
+
+void collectStageHistograms(LatencyHistogram* merged) {
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        merged[stage].reset();
+    }
+    for (StageHistograms* local = stageHistogramList; local; local = local->next) {
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            merged[stage].merge(local->stages[stage]);
+        }
+    }
+}
+
+// Turns stage timing off and frees the histograms. Only call while no thread
+// is recording.
+void releaseStageHistograms() {
+    stageTiming = false;
+    StageHistograms* local = __sync_lock_test_and_set(&stageHistogramList, (StageHistograms*)nullptr);
+    __sync_fetch_and_add(&stageHistogramGeneration, 1);
+    while (local) {
+        StageHistograms* next = local->next;
+        deleteAlignedArray(local, 1);
+        local = next;
+    }
+}
+
+// Work-stealing pool
+//
+// A fixed set of workers, one per hardware thread by default, each owning a
+// Chase-Lev deque: the owner pushes and pops at the bottom without a CAS in
+// the common case, and idle workers steal the oldest task from the top of a
+// random victim with one CAS. Tasks submitted from outside the pool go
+// round-robin onto the workers' MPSC inboxes, which each worker moves onto
+// its deque; tasks submitted by a task go straight onto its worker's deque.
+// Either way every queued task can be stolen. A task is
+// a function pointer and an argument, so submitting never allocates. Each
+// worker counts the tasks it ran, the tasks it stole and the time spent
+// running them, which gives its utilization over the pool's lifetime. With
+// NUMA placement worker i runs on node i % nodeCount.
+struct Task {
+    void (*run)(void*);
+    void* arg;
+};
+
+const size_t WORK_DEQUE_CAPACITY = 1 << 12;
+const size_t WORK_INBOX_CAPACITY = 1 << 10;
+
+class WorkStealingDeque {
+private:
+    Task* tasks;
+    size_t mask;
+    alignas(CACHE_LINE_SIZE) volatile long top;
+    alignas(CACHE_LINE_SIZE) volatile long bottom;
+
+public:
+    explicit WorkStealingDeque(size_t capacity) : tasks(new Task[capacity]), mask(capacity - 1), top(0), bottom(0) {}
+    ~WorkStealingDeque() { delete[] tasks; }
+
+    // Owner only. Fails when the deque is full.
+    bool push(const Task& task) {
+        long b = bottom;
+        long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        if (b - t > (long)mask) {
+            return false;
+        }
+        tasks[b & mask] = task;
+        __atomic_store_n(&bottom, b + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Owner only; newest task first.
+    bool pop(Task& task) {
+        long b = bottom - 1;
+        __atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long t = top;
+        if (t > b) {
+            __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        task = tasks[b & mask];
+        if (t == b) {
+            // Last task: race the thieves for it.
+            bool won = __sync_bool_compare_and_swap(&top, t, t + 1);
+            __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread; oldest task first. A lost race counts as empty.
+    bool steal(Task& task) {
+        long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+        if (t >= b) {
+            return false;
+        }
+        task = tasks[t & mask];
+        return __sync_bool_compare_and_swap(&top, t, t + 1);
+    }
+};
+
+struct PoolWorkerStats {
+    unsigned long tasks;
+    unsigned long steals;
+    uint64_t busyNanos;
+};
+
+struct alignas(CACHE_LINE_SIZE) PoolWorker {
+    WorkStealingDeque deque;
+    MpscRing<Task> inbox;
+    std::thread thread;
+    PoolWorkerStats stats;
+    uint64_t stealSeed;
+
+    PoolWorker() : deque(WORK_DEQUE_CAPACITY), inbox(WORK_INBOX_CAPACITY), stats(), stealSeed(0) {}
+};
+
+class WorkStealingPool {
+public:
+    WorkStealingPool() : workers(nullptr), count(0), pending(0), running(false), nextInbox(0), startNanos(0),
+                         elapsedNanos(0) {}
+
+    // threads <= 0 sizes the pool to the machine.
+    void start(int threads) {
+        count = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+        count = count > 0 ? count : 1;
+        workers = newAlignedArray<PoolWorker>(count);
+        running = true;
+        startNanos = nowNanos();
+        for (int i = 0; i < count; i++) {
+            workers[i].stealSeed = 0x9E3779B97F4A7C15ULL * (i + 1);
+            workers[i].thread = std::thread(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    void submit(void (*run)(void*), void* arg) {
+        Task task = { run, arg };
+        __sync_add_and_fetch(&pending, 1);
+        if (currentWorker >= 0 && currentPool == this) {
+            if (!workers[currentWorker].deque.push(task)) {
+                execute(workers[currentWorker], task);
+            }
+            return;
+        }
+        MpscRing<Task>& inbox = workers[__sync_fetch_and_add(&nextInbox, 1) % count].inbox;
+        while (!inbox.tryPush(task)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Waits until every submitted task, including those submitted by tasks,
+    // has run. Not for use from inside a task.
+    void wait() {
+        while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Runs what is left, then joins the workers.
+    void stop() {
+        wait();
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        for (int i = 0; i < count; i++) {
+            workers[i].thread.join();
+        }
+        elapsedNanos = nowNanos() - startNanos;
+    }
+
+    void release() {
+        deleteAlignedArray(workers, count);
+        workers = nullptr;
+        count = 0;
+    }
+
+    int size() const { return count; }
+    const PoolWorkerStats& workerStats(int worker) const { return workers[worker].stats; }
+
+    // Share of the pool's lifetime the worker spent running tasks; valid
+    // after stop().
+    double utilization(int worker) const {
+        return elapsedNanos > 0 ? (double)workers[worker].stats.busyNanos / elapsedNanos : 0;
+    }
+
+private:
+    PoolWorker* workers;
+    int count;
+    volatile long pending;
+    volatile bool running;
+    volatile unsigned long nextInbox;
+    uint64_t startNanos;
+    uint64_t elapsedNanos;
+    static thread_local int currentWorker;
+    static thread_local WorkStealingPool* currentPool;
+
+    void execute(PoolWorker& worker, const Task& task) {
+        uint64_t start = nowNanos();
+        task.run(task.arg);
+        worker.stats.busyNanos += nowNanos() - start;
+        worker.stats.tasks++;
+        __sync_sub_and_fetch(&pending, 1);
+    }
+
+    bool stealTask(PoolWorker& self, int selfIndex, Task& task) {
+        self.stealSeed ^= self.stealSeed << 13;
+        self.stealSeed ^= self.stealSeed >> 7;
+        self.stealSeed ^= self.stealSeed << 17;
+        int start = (int)(self.stealSeed % (uint64_t)count);
+        for (int k = 0; k < count; k++) {
+            int victim = (start + k) % count;
+            if (victim != selfIndex && workers[victim].deque.steal(task)) {
+                self.stats.steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int index) {
+        if (numaEnabled) {
+            enterNumaNode(index % numaNodeCount);
+        }
+        pinEngineThread(numShards + index);
+        currentWorker = index;
+        currentPool = this;
+        PoolWorker& self = workers[index];
+        int idleSpins = 0;
+        while (true) {
+            Task task;
+            // Move submissions onto the deque first so they can be stolen.
+            while (self.inbox.tryPop(task)) {
+                if (!self.deque.push(task)) {
+                    execute(self, task);
+                }
+            }
+            if (self.deque.pop(task) || stealTask(self, index, task)) {
+                execute(self, task);
+                idleSpins = 0;
+            } else if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+                break;
+            } else {
+                engineIdleWait(idleSpins);
+            }
+        }
+        currentWorker = -1;
+        currentPool = nullptr;
+    }
+};
+
+thread_local int WorkStealingPool::currentWorker = -1;
+thread_local WorkStealingPool* WorkStealingPool::currentPool = nullptr;
+
+// Simulation configuration and report
+enum ReportFormat { REPORT_TEXT, REPORT_CSV, REPORT_JSON };
+enum BenchmarkMode { BENCH_SIMULATION, BENCH_LAYOUT, BENCH_SOA, BENCH_REPLAY_CHECK, BENCH_CANCEL_CHECK };
+
+const long DEFAULT_RESTING_ORDERS = 1 << 16;
+
+struct SimulationConfig {
+    BenchmarkMode bench;
+    int books;
+    int brokers;
+    int workers;
+    long ordersPerBroker;
+    long restingOrders;
+    int tickers;
+    int arrayBooks;
+    unsigned long seed;
+    int shards;
+    int cancelPercent;
+    int batchSize;
+    int quoteReaders;
+    TradeSinkMode tradeMode;
+    const char* tradeLogPath;
+    const char* marketDataPath;
+    int snapshotMillis;
+    const char* journalPath;
+    const char* snapshotPath;
+    bool numa;
+    int numaFakeNodes;
+    const char* engineCpuList;
+    const char* isolatedCpuList;
+    IdleStrategy idle;
+    bool stageTiming;
+    ReportFormat format;
+
+    SimulationConfig()
+        : bench(BENCH_SIMULATION), books(DEFAULT_NUM_BOOKS), brokers(5), workers(0), ordersPerBroker(1000),
+          restingOrders(DEFAULT_RESTING_ORDERS), tickers(0), arrayBooks(0),
+          seed(12345), shards(0),
+          cancelPercent(0), batchSize(1), quoteReaders(0), tradeMode(TRADES_TEXT), tradeLogPath(nullptr),
+          marketDataPath(nullptr), snapshotMillis(1000), journalPath(nullptr), snapshotPath(nullptr),
+          numa(false), numaFakeNodes(0), engineCpuList(nullptr), isolatedCpuList(nullptr), idle(IDLE_BACKOFF),
+          stageTiming(false), format(REPORT_TEXT) {}
+};
+
+struct SimulationReport {
+    long orders;
+    unsigned long trades;
+    double seconds;
+    unsigned long casRetries;
+    unsigned long abortedMatches;
+    unsigned long quoteReads;
+    int workers;
+    PoolWorkerStats* workerStats;
+    double* workerUtilization;
+    int numaNodes;
+    unsigned long localMatches;
+    unsigned long remoteMatches;
+    bool numaCounters;
+    unsigned long localPages;
+    unsigned long remotePages;
+    LatencyHistogram latency;
+    LatencyHistogram stages[STAGE_COUNT]; // TSC cycles; empty without stage timing
+};
+
+// Cycles to nanoseconds for the stage breakdown.
+unsigned long stageNanos(uint64_t cycles) {
+    return (unsigned long)(cycles * tscNanosPerCycle + 0.5);
+}
+
+void printReport(const SimulationConfig& config, const SimulationReport& report) {
+    double ordersPerSec = report.seconds > 0 ? report.orders / report.seconds : 0;
+    double tradesPerSec = report.seconds > 0 ? report.trades / report.seconds : 0;
+    double quotesPerSec = report.seconds > 0 ? report.quoteReads / report.seconds : 0;
+    uint64_t p50 = report.latency.percentile(50.0);
+    uint64_t p99 = report.latency.percentile(99.0);
+    uint64_t p999 = report.latency.percentile(99.9);
+    uint64_t maxLatency = report.latency.max();
+    unsigned long steals = 0;
+    double meanUtilization = 0;
+    for (int i = 0; i < report.workers; i++) {
+        steals += report.workerStats[i].steals;
+        meanUtilization += report.workerUtilization[i] / report.workers;
+    }
+    unsigned long matches = report.localMatches + report.remoteMatches;
+    unsigned long pages = report.localPages + report.remotePages;
+    double localMatchRatio = matches > 0 ? (double)report.localMatches / matches : 0;
+    double localPageRatio = report.numaCounters && pages > 0 ? (double)report.localPages / pages : -1;
+
+    if (config.format == REPORT_CSV) {
+        printf("brokers,orders_per_broker,tickers,seed,shards,orders,trades,seconds,"
+               "orders_per_sec,trades_per_sec,cas_retries,aborted_matches,quotes_per_sec,p50_ns,p99_ns,p999_ns,max_ns,"
+               "workers,steals,worker_utilization,numa_nodes,numa_local_matches,numa_local_pages\n");
+        printf("%d,%ld,%d,%lu,%d,%ld,%lu,%.6f,%.0f,%.0f,%lu,%lu,%.0f,%lu,%lu,%lu,%lu,%d,%lu,%.3f,%d,%.3f,%.3f\n",
+               config.brokers, config.ordersPerBroker, config.tickers, config.seed, config.shards,
+               report.orders, report.trades, report.seconds, ordersPerSec, tradesPerSec,
+               report.casRetries, report.abortedMatches, quotesPerSec, (unsigned long)p50, (unsigned long)p99, (unsigned long)p999, (unsigned long)maxLatency,
+               report.workers, steals, meanUtilization, report.numaNodes, localMatchRatio, localPageRatio);
+        if (config.stageTiming) {
+            printf("stage,count,p50_ns,p99_ns,p999_ns,max_ns\n");
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                const LatencyHistogram& stage = report.stages[i];
+                printf("%s,%lu,%lu,%lu,%lu,%lu\n", STAGE_NAMES[i], stage.count(), stageNanos(stage.percentile(50.0)),
+                       stageNanos(stage.percentile(99.0)), stageNanos(stage.percentile(99.9)), stageNanos(stage.max()));
+            }
+        }
+    } else if (config.format == REPORT_JSON) {
+        printf("{\"brokers\": %d, \"orders_per_broker\": %ld, \"tickers\": %d, \"seed\": %lu, \"shards\": %d, "
+               "\"orders\": %ld, \"trades\": %lu, \"seconds\": %.6f, \"orders_per_sec\": %.0f, "
+               "\"trades_per_sec\": %.0f, \"cas_retries\": %lu, \"aborted_matches\": %lu, \"quotes_per_sec\": %.0f, \"latency_ns\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}, \"workers\": [",
+               config.brokers, config.ordersPerBroker, config.tickers, config.seed, config.shards,
+               report.orders, report.trades, report.seconds, ordersPerSec, tradesPerSec,
+               report.casRetries, report.abortedMatches, quotesPerSec,
+               (unsigned long)p50, (unsigned long)p99, (unsigned long)p999, (unsigned long)maxLatency);
+        for (int i = 0; i < report.workers; i++) {
+            printf("%s{\"tasks\": %lu, \"steals\": %lu, \"utilization\": %.3f}", i > 0 ? ", " : "",
+                   report.workerStats[i].tasks, report.workerStats[i].steals, report.workerUtilization[i]);
+        }
+        printf("], \"numa\": {\"nodes\": %d, \"local_matches\": %lu, \"remote_matches\": %lu, "
+               "\"local_pages\": %lu, \"remote_pages\": %lu}",
+               report.numaNodes, report.localMatches, report.remoteMatches, report.localPages, report.remotePages);
+        if (config.stageTiming) {
+            printf(", \"stages_ns\": {");
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                const LatencyHistogram& stage = report.stages[i];
+                printf("%s\"%s\": {\"count\": %lu, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}",
+                       i > 0 ? ", " : "", STAGE_NAMES[i], stage.count(), stageNanos(stage.percentile(50.0)),
+                       stageNanos(stage.percentile(99.0)), stageNanos(stage.percentile(99.9)), stageNanos(stage.max()));
+            }
+            printf("}");
+        }
+        printf("}\n");
+    } else {
+        printf("Orders: %ld in %.3f s (%.0f orders/sec)\n", report.orders, report.seconds, ordersPerSec);
+        printf("Trades: %lu (%.0f trades/sec)\n", report.trades, tradesPerSec);
+        printf("Fill contention: %lu CAS retries, %lu aborted matches\n", report.casRetries, report.abortedMatches);
+        if (config.quoteReaders > 0) {
+            printf("Top-of-book reads: %lu (%.0f reads/sec)\n", report.quoteReads, quotesPerSec);
+        }
+        printf("addOrder latency ns: p50 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+               (unsigned long)p50, (unsigned long)p99, (unsigned long)p999, (unsigned long)maxLatency);
+        for (int i = 0; i < report.workers; i++) {
+            printf("Worker %d: %lu tasks, %lu stolen, %.1f%% busy\n", i, report.workerStats[i].tasks,
+                   report.workerStats[i].steals, report.workerUtilization[i] * 100);
+        }
+        if (config.stageTiming) {
+            printf("Stage latency ns:\n");
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                const LatencyHistogram& stage = report.stages[i];
+                printf("  %-6s %10lu samples: p50 %lu, p99 %lu, p99.9 %lu, max %lu\n", STAGE_NAMES[i], stage.count(),
+                       stageNanos(stage.percentile(50.0)), stageNanos(stage.percentile(99.0)),
+                       stageNanos(stage.percentile(99.9)), stageNanos(stage.max()));
+            }
+        }
+        if (report.numaNodes > 0) {
+            printf("NUMA: %d nodes, %.1f%% of orders matched on the book's node (%lu local, %lu remote)\n",
+                   report.numaNodes, localMatchRatio * 100, report.localMatches, report.remoteMatches);
+            if (report.numaCounters) {
+                printf("NUMA pages allocated on the local node: %.1f%% (%lu local, %lu remote)\n",
+                       localPageRatio * 100, report.localPages, report.remotePages);
+            } else {
+                printf("NUMA page counters not available for this topology\n");
+            }
+        }
+    }
+}
+
+// Simulation functions
+// With cancelPercent > 0 that share of the operations cancels or amends one of
+// the broker's recent orders instead of sending a new one, the way a market
+// maker requotes. With batchSize > 1 new orders are collected into packets
+// and sent through addOrders; each order then records the packet's latency
+// divided by its size. A broker's whole state lives in BrokerState, so its
+// orders can be generated in slices by whichever thread runs the slice and
+// still come out the same for a given seed.
+const int RECENT_ORDERS = 64;
+const long BROKER_TASK_ORDERS = 1024;
+
+struct BrokerState {
+    int brokerId;
+    const SimulationConfig* config;
+    SimpleRandom rng;
+    LatencyHistogram* latency;
+    WorkStealingPool* pool;
+    long nextOrder;
+    uint64_t recentIds[RECENT_ORDERS];
+    double recentPrices[RECENT_ORDERS];
+    OrderRequest* pending;
+    uint64_t* pendingIds;
+    int* pendingSlots;
+    int pendingCount;
+
+    BrokerState(int id, const SimulationConfig* simulation, LatencyHistogram* histogram, WorkStealingPool* workers)
+        : brokerId(id), config(simulation), rng(simulation->seed, id), latency(histogram), pool(workers),
+          nextOrder(0), recentIds(), recentPrices(), pending(new OrderRequest[simulation->batchSize]),
+          pendingIds(new uint64_t[simulation->batchSize]), pendingSlots(new int[simulation->batchSize]),
+          pendingCount(0) {}
+
+    ~BrokerState() {
+        delete[] pending;
+        delete[] pendingIds;
+        delete[] pendingSlots;
+    }
+
+    bool done() const { return nextOrder >= config->ordersPerBroker; }
+};
+
+// Sends up to count of the broker's remaining orders.
+void simulateTransactions(BrokerState& broker, long count) {
+    const SimulationConfig& config = *broker.config;
+    SimpleRandom& rng = broker.rng;
+    long end = broker.nextOrder + count;
+    end = end < config.ordersPerBroker ? end : config.ordersPerBroker;
+    for (long i = broker.nextOrder; i < end; i++) {
+        if (config.cancelPercent > 0 && rng.randInt(1, 100) <= config.cancelPercent) {
+            int slot = rng.randInt(0, RECENT_ORDERS - 1);
+            uint64_t orderId = broker.recentIds[slot];
+            uint64_t start = nowNanos();
+            if (rng.randInt(0, 1) == 0) {
+                cancelOrder(orderId);
+                broker.recentIds[slot] = 0;
+            } else {
+                broker.recentIds[slot] = modifyOrder(orderId, rng.randInt(1, 100), broker.recentPrices[slot]);
+            }
+            broker.latency->record(nowNanos() - start);
+            continue;
+        }
+        OrderRequest& request = broker.pending[broker.pendingCount];
+        request.orderType = (rng.randInt(0, 1) == 0) ? BUY : SELL;
+        request.ticker = tickers[rng.randInt(0, config.tickers - 1)];
+        request.quantity = rng.randInt(1, 100);
+        request.price = rng.uniform(10.0, 100.0);
+        int slot = (int)(i % RECENT_ORDERS);
+        broker.pendingSlots[broker.pendingCount++] = slot;
+        broker.recentIds[slot] = 0;
+        broker.recentPrices[slot] = request.price;
+        if (broker.pendingCount < config.batchSize && i + 1 < config.ordersPerBroker) {
+            continue;
+        }
+        uint64_t start = nowNanos();
+        if (broker.pendingCount == 1) {
+            broker.pendingIds[0] = addOrder(request.orderType, request.ticker, request.quantity, request.price);
+        } else {
+            addOrders(broker.pending, broker.pendingCount, broker.pendingIds);
+        }
+        uint64_t perOrder = (nowNanos() - start) / broker.pendingCount;
+        for (int k = 0; k < broker.pendingCount; k++) {
+            broker.latency->record(perOrder);
+            broker.recentIds[broker.pendingSlots[k]] = broker.pendingIds[k];
+        }
+        broker.pendingCount = 0;
+    }
+    broker.nextOrder = end;
+}
+
+void brokerFinished(const BrokerState& broker) {
+    if (broker.config->format == REPORT_TEXT) {
+        printf("Broker %d completed activities\n", broker.brokerId);
+    }
+}
+
+// One slice of a broker's orders as a pool task. The next slice goes onto
+// the running worker's deque, so an idle worker can steal the broker while
+// this one moves on to another.
+void brokerTask(void* arg) {
+    BrokerState& broker = *(BrokerState*)arg;
+    setOrderSource(broker.brokerId);
+    simulateTransactions(broker, BROKER_TASK_ORDERS);
+    if (broker.done()) {
+        brokerFinished(broker);
+    } else {
+        broker.pool->submit(brokerTask, arg);
+    }
+}
+
+// Quote readers poll the top of book of random tickers while the brokers run,
+// the way risk and quoting systems do.
+volatile bool quoteReadersRunning = false;
+volatile uint64_t quoteSink = 0; // keeps the reads from being optimised away
+
+void quoteReaderFunction(int readerId, const SimulationConfig* config, unsigned long* reads) {
+    SimpleRandom rng(config->seed, config->brokers + readerId);
+    unsigned long count = 0;
+    uint64_t quantitySum = 0;
+    while (__atomic_load_n(&quoteReadersRunning, __ATOMIC_ACQUIRE)) {
+        for (int i = 0; i < 256; i++) {
+            Quote bid, ask;
+            getTopOfBook(tickers[rng.randInt(0, config->tickers - 1)], bid, ask);
+            quantitySum += (uint64_t)bid.quantity + ask.quantity;
+        }
+        count += 256;
+    }
+    quoteSink = quantitySum;
+    *reads = count;
+}
+
+// Latency is measured around each addOrder call; in sharded mode that is the
+// time to enqueue, while throughput includes draining the shards.
+void runSimulation(const SimulationConfig& config) {
+    bool verbose = config.format == REPORT_TEXT;
+    if (verbose) {
+        printf("Starting stock exchange simulation with threads...\n");
+    }
+    unsigned long localPagesBefore = 0;
+    unsigned long remotePagesBefore = 0;
+    bool numaCounters = false;
+    if (config.numa) {
+        initNuma(config.numaFakeNodes);
+        numaCounters = readNumaCounters(localPagesBefore, remotePagesBefore);
+        if (verbose) {
+            printf("NUMA placement over %d %snodes\n", numaNodeCount, numaNodes[0].osNode < 0 ? "fake " : "");
+        }
+    }
+    if (!configureEngineThreads(config.engineCpuList, config.isolatedCpuList, config.idle)) {
+        fprintf(stderr, "Cannot apply the engine CPU lists\n");
+        return;
+    }
+    if (config.stageTiming) {
+        enableStageTiming();
+        if (verbose) {
+            printf("Stage timing on, %.3f ns per TSC cycle\n", tscNanosPerCycle);
+        }
+    }
+    if (verbose && (engineCpuCount > 0 || engineIdle == IDLE_BUSY_POLL)) {
+        printf("Engine threads: %d pinned CPUs, %s when idle\n", engineCpuCount,
+               engineIdle == IDLE_BUSY_POLL ? "busy-poll" : "back off");
+    }
+    initOrderBooks(config.books, config.restingOrders);
+    if (!initTickers() || !startTradeSink(config.tradeMode, config.tradeLogPath)) {
+        cleanupTickers();
+        cleanupOrderBooks();
+        return;
+    }
+    for (int i = 0; i < config.arrayBooks; i++) {
+        useArrayBook(tickers[i]);
+    }
+    if (config.marketDataPath && !startMarketData(config.marketDataPath, config.snapshotMillis)) {
+        stopTradeSink();
+        cleanupTickers();
+        cleanupOrderBooks();
+        return;
+    }
+    uint64_t snapshotSequence = 0;
+    if (config.snapshotPath) {
+        uint64_t restoreStart = nowNanos();
+        long restored = restoreBooks(config.snapshotPath, &snapshotSequence);
+        if (restored < 0) {
+            stopTradeSink();
+            stopMarketData();
+            cleanupTickers();
+            cleanupOrderBooks();
+            return;
+        }
+        if (verbose) {
+            printf("Restored %ld resting orders from snapshot %s in %.3f ms\n", restored, config.snapshotPath,
+                   (nowNanos() - restoreStart) / 1e6);
+        }
+    }
+    if (config.journalPath) {
+        long restored = replayJournal(config.journalPath, snapshotSequence);
+        if (restored < 0 || !startJournal(config.journalPath)) {
+            stopTradeSink();
+            stopMarketData();
+            cleanupTickers();
+            cleanupOrderBooks();
+            return;
+        }
+        if (verbose) {
+            printf("Replayed journal %s after sequence %lu: %ld orders restored\n", config.journalPath,
+                   (unsigned long)snapshotSequence, restored);
+        }
+    }
+    if (config.shards > 0) {
+        startShards(config.shards);
+    }
+
+    WorkStealingPool pool;
+    BrokerState** brokers = new BrokerState*[config.brokers];
+    LatencyHistogram* latencies = new LatencyHistogram[config.brokers];
+    std::thread* readerThreads = new std::thread[config.quoteReaders];
+    unsigned long* quoteReads = new unsigned long[config.quoteReaders];
+    quoteReadersRunning = true;
+    for (int i = 0; i < config.quoteReaders; i++) {
+        readerThreads[i] = std::thread(quoteReaderFunction, i, &config, &quoteReads[i]);
+    }
+    pool.start(config.workers);
+    uint64_t start = nowNanos();
+    for (int i = 0; i < config.brokers; i++) {
+        brokers[i] = new BrokerState(i, &config, &latencies[i], &pool);
+        pool.submit(brokerTask, brokers[i]);
+    }
+    pool.stop();
+    stopShards();
+    uint64_t elapsed = nowNanos() - start;
+    unsigned long localPagesAfter = 0;
+    unsigned long remotePagesAfter = 0;
+    numaCounters = numaCounters && readNumaCounters(localPagesAfter, remotePagesAfter);
+    __atomic_store_n(&quoteReadersRunning, false, __ATOMIC_RELEASE);
+    for (int i = 0; i < config.quoteReaders; i++) {
+        readerThreads[i].join();
+    }
+    stopTradeSink();
+    stopMarketData();
+    stopJournal();
+    if (verbose && config.journalPath) {
+        printf("Journal: %lu records through sequence %lu in %lu group commits\n",
+               journalAppended, (unsigned long)journalSequence, journalCommits);
+    }
+    if (config.snapshotPath && snapshotBooks(config.snapshotPath) && verbose) {
+        printf("Wrote snapshot %s at journal sequence %lu\n", config.snapshotPath, (unsigned long)journalSequence);
+    }
+
+    SimulationReport* report = new SimulationReport();
+    report->orders = config.brokers * config.ordersPerBroker;
+    report->trades = tradesWritten + tradesDropped;
+    report->seconds = elapsed / 1e9;
+    MatchStats matchStats = collectMatchStats();
+    report->casRetries = matchStats.casRetries;
+    report->abortedMatches = matchStats.abortedMatches;
+    report->numaNodes = config.numa ? numaNodeCount : 0;
+    report->localMatches = matchStats.localMatches;
+    report->remoteMatches = matchStats.remoteMatches;
+    report->numaCounters = numaCounters;
+    report->localPages = numaCounters ? localPagesAfter - localPagesBefore : 0;
+    report->remotePages = numaCounters ? remotePagesAfter - remotePagesBefore : 0;
+    report->quoteReads = 0;
+    for (int i = 0; i < config.quoteReaders; i++) {
+        report->quoteReads += quoteReads[i];
+    }
+    for (int i = 0; i < config.brokers; i++) {
+        report->latency.merge(latencies[i]);
+    }
+    collectStageHistograms(report->stages);
+    report->workers = pool.size();
+    report->workerStats = new PoolWorkerStats[pool.size()];
+    report->workerUtilization = new double[pool.size()];
+    for (int i = 0; i < pool.size(); i++) {
+        report->workerStats[i] = pool.workerStats(i);
+        report->workerUtilization[i] = pool.utilization(i);
+    }
+    if (verbose) {
+        printf("Simulation completed\n");
+    }
+    printReport(config, *report);
+
+    delete[] report->workerStats;
+    delete[] report->workerUtilization;
+    delete report;
+    pool.release();
+    for (int i = 0; i < config.brokers; i++) {
+        delete brokers[i];
+    }
+    delete[] brokers;
+    delete[] latencies;
+    delete[] quoteReads;
+    delete[] readerThreads;
+    cleanupTickers();
+    cleanupOrderBooks();
+    releaseStageHistograms();
+}
+
+// Replay check
+//
+// Round-trips the journal and a snapshot and checks that the books come back
+// with every level in the same queue order. A first round of brokers trades
+// with the journal on and is snapshotted; a second round, with another seed,
+// is journaled after it and snapshotted again as the expected state. Fresh
+// books then restore the first snapshot, replay the journal after its
+// sequence and are snapshotted once more; the two final snapshots, which list
+// each level in queue order, must be byte for byte the same.
+void runBrokerRound(const SimulationConfig& config) {
+    WorkStealingPool pool;
+    BrokerState** brokers = new BrokerState*[config.brokers];
+    LatencyHistogram* latencies = new LatencyHistogram[config.brokers];
+    if (config.shards > 0) {
+        startShards(config.shards);
+    }
+    pool.start(config.workers);
+    for (int i = 0; i < config.brokers; i++) {
+        brokers[i] = new BrokerState(i, &config, &latencies[i], &pool);
+        pool.submit(brokerTask, brokers[i]);
+    }
+    pool.stop();
+    stopShards();
+    pool.release();
+    for (int i = 0; i < config.brokers; i++) {
+        delete brokers[i];
+    }
+    delete[] brokers;
+    delete[] latencies;
+}
+
+bool sameFileContents(const char* leftPath, const char* rightPath) {
+    FILE* left = fopen(leftPath, "rb");
+    FILE* right = fopen(rightPath, "rb");
+    bool same = left && right;
+    char leftBuffer[1 << 16];
+    char rightBuffer[1 << 16];
+    while (same) {
+        size_t leftRead = fread(leftBuffer, 1, sizeof(leftBuffer), left);
+        size_t rightRead = fread(rightBuffer, 1, sizeof(rightBuffer), right);
+        same = leftRead == rightRead && memcmp(leftBuffer, rightBuffer, leftRead) == 0;
+        if (leftRead == 0) {
+            break;
+        }
+    }
+    if (left) {
+        fclose(left);
+    }
+    if (right) {
+        fclose(right);
+    }
+    return same;
+}
+
+bool runReplayCheck(const SimulationConfig& config) {
+    char journalPath[64];
+    char firstPath[64];
+    char expectedPath[64];
+    char replayedPath[64];
+    snprintf(journalPath, sizeof(journalPath), "/tmp/replay-check-%d.jnl", (int)getpid());
+    snprintf(firstPath, sizeof(firstPath), "/tmp/replay-check-%d.first", (int)getpid());
+    snprintf(expectedPath, sizeof(expectedPath), "/tmp/replay-check-%d.expected", (int)getpid());
+    snprintf(replayedPath, sizeof(replayedPath), "/tmp/replay-check-%d.replayed", (int)getpid());
+    unlink(journalPath);
+    SimulationConfig round = config;
+    round.format = REPORT_CSV; // keeps brokers quiet
+
+    bool ok = false;
+    long restored = 0;
+    initOrderBooks(config.books, config.restingOrders);
+    if (initTickers() && startTradeSink(TRADES_DISCARD, nullptr) && startJournal(journalPath)) {
+        for (int i = 0; i < config.arrayBooks; i++) {
+            useArrayBook(tickers[i]);
+        }
+        runBrokerRound(round);
+        stopJournal();
+        ok = snapshotBooks(firstPath) && startJournal(journalPath);
+        if (ok) {
+            round.seed = config.seed + 1;
+            runBrokerRound(round);
+            stopJournal();
+            ok = snapshotBooks(expectedPath);
+        }
+    }
+    stopTradeSink();
+    cleanupTickers();
+    cleanupOrderBooks();
+
+    if (ok) {
+        initOrderBooks(config.books, config.restingOrders);
+        uint64_t snapshotSequence = 0;
+        ok = initTickers() && startTradeSink(TRADES_DISCARD, nullptr);
+        for (int i = 0; ok && i < config.arrayBooks; i++) {
+            useArrayBook(tickers[i]);
+        }
+        ok = ok && restoreBooks(firstPath, &snapshotSequence) >= 0;
+        restored = ok ? replayJournal(journalPath, snapshotSequence) : -1;
+        ok = ok && restored >= 0;
+        stopTradeSink();
+        ok = ok && snapshotBooks(replayedPath) && sameFileContents(expectedPath, replayedPath);
+        cleanupTickers();
+        cleanupOrderBooks();
+    }
+    printf("Replay check %s: %ld orders replayed after the snapshot\n", ok ? "passed" : "FAILED", restored);
+    unlink(journalPath);
+    unlink(firstPath);
+    unlink(expectedPath);
+    unlink(replayedPath);
+    return ok;
+}
+
+// Cancel check
+//
+// Pairs of threads race cancels against matches on one price of the first
+// book: each matcher enters orders of either side, which all cross, and its
+// canceller keeps trying to cancel the latest one, often while it is still
+// matching. An order whose cancel succeeded must never get shares back
+// from a fill in flight, and the level must hold exactly what its orders
+// still have.
+const int CANCEL_CHECK_PRICE_TICKS = 1000;
+
+struct CancelCheckLane {
+    volatile uint64_t latest;
+    volatile bool done;
+    uint64_t* cancelled;
+    long cancelledCount;
+};
+
+// The id is published before the order is entered, so the canceller can hit
+// it at any point of its match.
+void cancelCheckMatcher(CancelCheckLane* lane, long orders, unsigned long seed, int laneId) {
+    SimpleRandom rng(seed, laneId);
+    OrderBook& book = bookAt(0);
+    for (long i = 0; i < orders; i++) {
+        OrderType side = rng.randInt(0, 1) ? BUY : SELL;
+        Order order(side, tickers[0], rng.randInt(1, 3), CANCEL_CHECK_PRICE_TICKS, nextOrderId());
+        __atomic_store_n(&lane->latest, order.orderId, __ATOMIC_RELEASE);
+        book.addOrder(order);
+    }
+    lane->done = true;
+}
+
+// Retries the latest order until a cancel succeeds or a newer one replaces it.
+void cancelCheckCanceller(CancelCheckLane* lane) {
+    uint64_t cancelled = 0;
+    while (!lane->done) {
+        uint64_t orderId = __atomic_load_n(&lane->latest, __ATOMIC_ACQUIRE);
+        if (orderId != cancelled && cancelOrder(orderId)) {
+            cancelled = orderId;
+            lane->cancelled[lane->cancelledCount++] = orderId;
+        }
+    }
+}
+
+struct RestingTotal {
+    int64_t quantity;
+
+    void operator()(const Order& order) { quantity += order.availableQuantity(); }
+};
+
+bool runCancelCheck(const SimulationConfig& config) {
+    int lanes = config.brokers > 0 ? config.brokers : 1;
+    bool ok = false;
+    long cancels = 0;
+    initOrderBooks(config.books, config.restingOrders);
+    if (initTickers() && startTradeSink(TRADES_DISCARD, nullptr)) {
+        CancelCheckLane* lane = new CancelCheckLane[lanes];
+        std::thread* threads = new std::thread[lanes * 2];
+        for (int i = 0; i < lanes; i++) {
+            lane[i].latest = 0;
+            lane[i].done = false;
+            lane[i].cancelled = new uint64_t[config.ordersPerBroker];
+            lane[i].cancelledCount = 0;
+            threads[i * 2] = std::thread(cancelCheckMatcher, &lane[i], config.ordersPerBroker, config.seed, i);
+            threads[i * 2 + 1] = std::thread(cancelCheckCanceller, &lane[i]);
+        }
+        for (int i = 0; i < lanes * 2; i++) {
+            threads[i].join();
+        }
+        ok = true;
+        {
+            EpochGuard guard;
+            for (int i = 0; i < lanes; i++) {
+                for (long j = 0; j < lane[i].cancelledCount; j++) {
+                    OrderNode* node = orderIndex.find(lane[i].cancelled[j]);
+                    if (node && node->order.availableQuantity() > 0) {
+                        fprintf(stderr, "Cancelled order %llu still has %d shares\n",
+                                (unsigned long long)lane[i].cancelled[j], node->order.availableQuantity());
+                        ok = false;
+                    }
+                }
+                cancels += lane[i].cancelledCount;
+                delete[] lane[i].cancelled;
+            }
+            OrderBook& book = bookAt(0);
+            for (int side = BUY; side <= SELL; side++) {
+                RestingTotal total = { 0 };
+                book.forEachRestingOrder((OrderType)side, total);
+                if (total.quantity != topQuantityOf(book.topOf((OrderType)side))) {
+                    fprintf(stderr, "Level holds %d shares but its orders have %lld\n",
+                            topQuantityOf(book.topOf((OrderType)side)), (long long)total.quantity);
+                    ok = false;
+                }
+            }
+        }
+        delete[] threads;
+        delete[] lane;
+    }
+    stopTradeSink();
+    cleanupTickers();
+    cleanupOrderBooks();
+    printf("Cancel check %s: %ld cancels raced against matches\n", ok ? "passed" : "FAILED", cancels);
+    return ok;
+}
+
+// Layout benchmark
+//
+// Every thread works only on its own ticker and the tickers are neighbours in
+// memory, so any slowdown as threads are added comes from cache lines shared
+// between books rather than from contention on a book. The head variants
+// replay just the side-head CAS traffic on the layout OrderBook used to have
+// (both heads packed next to the neighbouring book's) and on the aligned one;
+// the engine variant drives real OrderBooks with crossing orders.
+struct PackedBookHeads {
+    volatile uintptr_t buyHead;
+    volatile uintptr_t sellHead;
+};
+
+struct AlignedBookHeads {
+    alignas(CACHE_LINE_SIZE) volatile uintptr_t buyHead;
+    alignas(CACHE_LINE_SIZE) volatile uintptr_t sellHead;
+};
+
+template <typename Heads>
+void hammerBookHeads(Heads* heads, long operations) {
+    for (long i = 0; i < operations; i++) {
+        volatile uintptr_t* head = (i & 1) ? &heads->sellHead : &heads->buyHead;
+        uintptr_t old;
+        do {
+            old = *head;
+        } while (!__sync_bool_compare_and_swap(head, old, old + 1));
+    }
+}
+
+template <typename Heads>
+uint64_t timeBookHeads(int threads, long operations) {
+    Heads* heads = newAlignedArray<Heads>(threads);
+    std::thread* workers = new std::thread[threads];
+    uint64_t start = nowNanos();
+    for (int i = 0; i < threads; i++) {
+        workers[i] = std::thread(hammerBookHeads<Heads>, &heads[i], operations);
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].join();
+    }
+    uint64_t elapsed = nowNanos() - start;
+    delete[] workers;
+    deleteAlignedArray(heads, threads);
+    return elapsed;
+}
+
+void crossOwnTicker(int tickerIndex, long orders) {
+    for (long i = 0; i < orders; i++) {
+        addOrder((i & 1) ? SELL : BUY, tickers[tickerIndex], 1, 50.0);
+    }
+}
+
+uint64_t timeEngineTickers(int threads, long orders) {
+    std::thread* workers = new std::thread[threads];
+    uint64_t start = nowNanos();
+    for (int i = 0; i < threads; i++) {
+        workers[i] = std::thread(crossOwnTicker, i, orders);
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].join();
+    }
+    uint64_t elapsed = nowNanos() - start;
+    delete[] workers;
+    return elapsed;
+}
+
+void printLayoutResult(const SimulationConfig& config, const char* variant, int threads, long operations,
+                       uint64_t elapsed) {
+    double nsPerOp = (double)elapsed / operations;
+    double opsPerSec = elapsed > 0 ? operations * 1e9 / elapsed : 0;
+    if (config.format == REPORT_CSV) {
+        printf("%s,%d,%ld,%.2f,%.0f\n", variant, threads, operations, nsPerOp, opsPerSec);
+    } else if (config.format == REPORT_JSON) {
+        printf("{\"variant\": \"%s\", \"threads\": %d, \"operations\": %ld, \"ns_per_op\": %.2f, "
+               "\"ops_per_sec\": %.0f}\n", variant, threads, operations, nsPerOp, opsPerSec);
+    } else {
+        printf("%-14s threads %2d: %8.2f ns/op (%.0f ops/sec)\n", variant, threads, nsPerOp, opsPerSec);
+    }
+}
+
+// Runs each variant with 1..brokers threads; the single-thread row is the
+// baseline without any cross-ticker interference.
+void runLayoutBenchmark(const SimulationConfig& config) {
+    int maxThreads = config.brokers < DEFAULT_NUM_BOOKS ? config.brokers : DEFAULT_NUM_BOOKS;
+    long operations = config.ordersPerBroker;
+    if (config.format == REPORT_CSV) {
+        printf("variant,threads,operations,ns_per_op,ops_per_sec\n");
+    }
+    for (int threads = 1; threads <= maxThreads; threads++) {
+        uint64_t elapsed = timeBookHeads<PackedBookHeads>(threads, operations);
+        printLayoutResult(config, "heads-packed", threads, operations * threads, elapsed);
+        elapsed = timeBookHeads<AlignedBookHeads>(threads, operations);
+        printLayoutResult(config, "heads-aligned", threads, operations * threads, elapsed);
+
+        initOrderBooks(DEFAULT_NUM_BOOKS);
+        if (!initTickers() || !startTradeSink(TRADES_DISCARD)) {
+            cleanupTickers();
+            cleanupOrderBooks();
+            return;
+        }
+        elapsed = timeEngineTickers(threads, operations);
+        stopTradeSink();
+        cleanupTickers();
+        cleanupOrderBooks();
+        printLayoutResult(config, "engine", threads, operations * threads, elapsed);
+    }
+}
+
+// Structure-of-arrays benchmark
+//
+// Keeps one book at a fixed depth of single-lot orders on each side and
+// times an operation made of an aggressive order that takes the best resting
+// order plus a passive order that replaces it, alternating sides. The engine
+// variant runs the lock-free skip-list book on one thread; the soa variants
+// run SoaOrderBook with each kernel the CPU supports, so the rows show where
+// a linear vector scan stops paying for itself against the sorted levels.
+const int SOA_BENCH_DEPTHS[] = {16, 64, 256, 1024};
+const int SOA_BENCH_MID_TICKS = 100000;
+
+// Passive order at a random price within depth ticks of the mid.
+Order soaBenchPassive(SimpleRandom& rng, OrderType type, int depth) {
+    int offset = rng.randInt(1, depth);
+    int ticks = (type == SELL) ? SOA_BENCH_MID_TICKS + offset : SOA_BENCH_MID_TICKS - offset;
+    return Order(type, TickerString(), 1, ticks, nextOrderId());
+}
+
+Order soaBenchAggressor(OrderType type, int depth) {
+    int ticks = (type == BUY) ? SOA_BENCH_MID_TICKS + depth : SOA_BENCH_MID_TICKS - depth;
+    return Order(type, TickerString(), 1, ticks, nextOrderId());
+}
+
+template <typename Book>
+uint64_t timeSoaOperations(Book& book, int depth, long operations, uint32_t seed) {
+    SimpleRandom rng(seed);
+    for (int i = 0; i < depth; i++) {
+        book.matchOrder(soaBenchPassive(rng, BUY, depth));
+        book.matchOrder(soaBenchPassive(rng, SELL, depth));
+    }
+    uint64_t start = nowNanos();
+    for (long i = 0; i < operations; i++) {
+        OrderType aggressor = (i & 1) ? SELL : BUY;
+        book.matchOrder(soaBenchAggressor(aggressor, depth));
+        book.matchOrder(soaBenchPassive(rng, aggressor == BUY ? SELL : BUY, depth));
+    }
+    return nowNanos() - start;
+}
+
+// Adapts the lock-free book to the single-argument matchOrder used above.
+struct EngineBenchBook {
+    OrderBook& book;
+    void matchOrder(const Order& order) { book.addOrder(order); }
+};
+
+void printSoaResult(const SimulationConfig& config, const char* variant, int depth, long operations,
+                    uint64_t elapsed) {
+    double nsPerOp = (double)elapsed / operations;
+    double opsPerSec = elapsed > 0 ? operations * 1e9 / elapsed : 0;
+    if (config.format == REPORT_CSV) {
+        printf("%s,%d,%ld,%.2f,%.0f\n", variant, depth, operations, nsPerOp, opsPerSec);
+    } else if (config.format == REPORT_JSON) {
+        printf("{\"variant\": \"%s\", \"depth\": %d, \"operations\": %ld, \"ns_per_op\": %.2f, "
+               "\"ops_per_sec\": %.0f}\n", variant, depth, operations, nsPerOp, opsPerSec);
+    } else {
+        printf("%-14s depth %4d: %8.2f ns/op (%.0f ops/sec)\n", variant, depth, nsPerOp, opsPerSec);
+    }
+}
+
+void runSoaBenchmark(const SimulationConfig& config) {
+    long operations = config.ordersPerBroker > 0 ? config.ordersPerBroker : 1;
+    if (config.format == REPORT_CSV) {
+        printf("variant,depth,operations,ns_per_op,ops_per_sec\n");
+    }
+    setOrderSource(0);
+    for (size_t d = 0; d < sizeof(SOA_BENCH_DEPTHS) / sizeof(SOA_BENCH_DEPTHS[0]); d++) {
+        int depth = SOA_BENCH_DEPTHS[d];
+        initOrderBooks(1);
+        EngineBenchBook engine = {bookAt(0)};
+        uint64_t elapsed = timeSoaOperations(engine, depth, operations, config.seed);
+        cleanupOrderBooks();
+        printSoaResult(config, "engine", depth, operations, elapsed);
+
+        const SoaKernel kernels[] = {SOA_SCALAR, SOA_AVX2, SOA_AVX512};
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (!soaKernelSupported(kernels[k])) {
+                continue;
+            }
+            char variant[32];
+            snprintf(variant, sizeof(variant), "soa-%s", soaKernelName(kernels[k]));
+            SoaOrderBook book(kernels[k]);
+            elapsed = timeSoaOperations(book, depth, operations, config.seed);
+            printSoaResult(config, variant, depth, operations, elapsed);
+        }
+    }
+}
+
+void printUsage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--bench simulation|layout|soa|replay|cancel] [--books N] [--brokers N]\n"
+            "          [--workers N] [--orders N] [--tickers N] [--resting N] [--array-books N] [--seed N]\n"
+            "          [--shards N] [--cancels PCT] [--batch N] [--quote-readers N]\n"
+            "          [--trades text|binary:PATH|discard] [--market-data PATH] [--snapshot-ms N] [--journal PATH]\n"
+            "          [--snapshot PATH] [--numa on|fake[:N]] [--cpus LIST] [--isolated-cpus LIST]\n"
+            "          [--idle backoff|poll] [--stage-timing on|off] [--format text|csv|json]\n"
+            "  --books sets the ticker universe (1024 by default); books are only allocated once\n"
+            "  used, and brokers trade the first --tickers of them (all by default).\n"
+            "  --workers sizes the work-stealing pool that runs the brokers (0, the default,\n"
+            "  uses one worker per hardware thread).\n"
+            "  --orders is the number of operations each broker submits; --cancels makes PCT%% of\n"
+            "  them cancels or amendments of the broker's recent orders; --batch sends new orders\n"
+            "  through addOrders in packets of N.\n"
+            "  --resting is the expected number of resting orders (65536 by default); order\n"
+            "  nodes and the order index are sized for it up front and grow past it.\n"
+            "  --array-books puts the first N tickers' books on the single-writer array\n"
+            "  representation; it needs --shards.\n"
+            "  --quote-readers polls the top of book from N extra threads while brokers run.\n"
+            "  --market-data writes an L2 update stream with a full snapshot every --snapshot-ms.\n"
+            "  --journal replays PATH into the books if it exists and appends every order, fill\n"
+            "  and cancel to it.\n"
+            "  --snapshot restores the books from PATH if it exists and saves them there at exit;\n"
+            "  with --journal only the records after the snapshot are replayed.\n"
+            "  --numa on partitions the books over the NUMA nodes in /sys/devices/system/node,\n"
+            "  allocates them from node-local arenas and pins shards and workers to their node;\n"
+            "  fake:N splits the CPUs into N pretend nodes instead (one by default).\n"
+            "  --cpus pins each engine thread (shards, then pool workers) to one CPU of LIST,\n"
+            "  e.g. 2-5,8; --isolated-cpus reserves LIST for them and keeps every other thread\n"
+            "  off it; --idle poll makes idle engine threads busy-poll instead of yielding.\n"
+            "  --stage-timing on adds a per-stage latency breakdown of the order path\n"
+            "  (create, route, append, match iteration, fill publication) from TSC stamps.\n"
+            "  --bench layout measures cross-ticker interference with 1..brokers threads.\n"
+            "  --bench soa compares the skip-list book with the SIMD array book at several depths.\n"
+            "  --bench replay checks that a journal and snapshot round trip keeps queue order.\n"
+            "  --bench cancel races cancels against matches on --brokers pairs of threads.\n",
+            program);
+}
+
+bool parseArguments(int argc, char** argv, SimulationConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (strcmp(arg, "--bench") == 0) {
+            if (strcmp(value, "simulation") == 0) {
+                config.bench = BENCH_SIMULATION;
+            } else if (strcmp(value, "layout") == 0) {
+                config.bench = BENCH_LAYOUT;
+            } else if (strcmp(value, "soa") == 0) {
+                config.bench = BENCH_SOA;
+            } else if (strcmp(value, "replay") == 0) {
+                config.bench = BENCH_REPLAY_CHECK;
+            } else if (strcmp(value, "cancel") == 0) {
+                config.bench = BENCH_CANCEL_CHECK;
+            } else {
+                return false;
+            }
+        } else if (strcmp(arg, "--brokers") == 0) {
+            config.brokers = atoi(value);
+        } else if (strcmp(arg, "--workers") == 0) {
+            config.workers = atoi(value);
+        } else if (strcmp(arg, "--orders") == 0) {
+            config.ordersPerBroker = atol(value);
+        } else if (strcmp(arg, "--resting") == 0) {
+            config.restingOrders = atol(value);
+        } else if (strcmp(arg, "--array-books") == 0) {
+            config.arrayBooks = atoi(value);
+        } else if (strcmp(arg, "--books") == 0) {
+            config.books = atoi(value);
+        } else if (strcmp(arg, "--tickers") == 0) {
+            config.tickers = atoi(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            config.seed = strtoul(value, nullptr, 10);
+        } else if (strcmp(arg, "--shards") == 0) {
+            config.shards = atoi(value);
+        } else if (strcmp(arg, "--cancels") == 0) {
+            config.cancelPercent = atoi(value);
+        } else if (strcmp(arg, "--batch") == 0) {
+            config.batchSize = atoi(value);
+        } else if (strcmp(arg, "--quote-readers") == 0) {
+            config.quoteReaders = atoi(value);
+        } else if (strcmp(arg, "--trades") == 0) {
+            if (strcmp(value, "text") == 0) {
+                config.tradeMode = TRADES_TEXT;
+            } else if (strcmp(value, "discard") == 0) {
+                config.tradeMode = TRADES_DISCARD;
+            } else if (strncmp(value, "binary:", 7) == 0 && value[7] != '\0') {
+                config.tradeMode = TRADES_BINARY;
+                config.tradeLogPath = value + 7;
+            } else {
+                return false;
+            }
+        } else if (strcmp(arg, "--market-data") == 0) {
+            config.marketDataPath = value;
+        } else if (strcmp(arg, "--snapshot") == 0) {
+            config.snapshotPath = value;
+        } else if (strcmp(arg, "--journal") == 0) {
+            config.journalPath = value;
+        } else if (strcmp(arg, "--numa") == 0) {
+            config.numa = true;
+            if (strcmp(value, "on") == 0) {
+                config.numaFakeNodes = 0;
+            } else if (strcmp(value, "fake") == 0) {
+                config.numaFakeNodes = 1;
+            } else if (strncmp(value, "fake:", 5) == 0 && atoi(value + 5) > 0) {
+                config.numaFakeNodes = atoi(value + 5);
+            } else {
+                return false;
+            }
+        } else if (strcmp(arg, "--cpus") == 0 || strcmp(arg, "--isolated-cpus") == 0) {
+            cpu_set_t cpus;
+            if (parseCpuList(value, cpus) <= 0) {
+                return false;
+            }
+            (strcmp(arg, "--cpus") == 0 ? config.engineCpuList : config.isolatedCpuList) = value;
+        } else if (strcmp(arg, "--stage-timing") == 0) {
+            if (strcmp(value, "on") == 0) {
+                config.stageTiming = true;
+            } else if (strcmp(value, "off") == 0) {
+                config.stageTiming = false;
+            } else {
+                return false;
+            }
+        } else if (strcmp(arg, "--idle") == 0) {
+            if (strcmp(value, "backoff") == 0) {
+                config.idle = IDLE_BACKOFF;
+            } else if (strcmp(value, "poll") == 0) {
+                config.idle = IDLE_BUSY_POLL;
+            } else {
+                return false;
+            }
+        } else if (strcmp(arg, "--snapshot-ms") == 0) {
+            config.snapshotMillis = atoi(value);
+        } else if (strcmp(arg, "--format") == 0) {
+            if (strcmp(value, "text") == 0) {
+                config.format = REPORT_TEXT;
+            } else if (strcmp(value, "csv") == 0) {
+                config.format = REPORT_CSV;
+            } else if (strcmp(value, "json") == 0) {
+                config.format = REPORT_JSON;
+            } else {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    if (config.tickers == 0) {
+        config.tickers = config.books;
+    }
+    if (config.brokers <= 0) {
+        fprintf(stderr, "--brokers must be at least 1\n");
+        return false;
+    }
+    if (config.workers < 0) {
+        fprintf(stderr, "--workers must not be negative\n");
+        return false;
+    }
+    if (config.ordersPerBroker < 0) {
+        fprintf(stderr, "--orders must not be negative\n");
+        return false;
+    }
+    if (config.restingOrders < 0) {
+        fprintf(stderr, "--resting must not be negative\n");
+        return false;
+    }
+    if (config.shards < 0) {
+        fprintf(stderr, "--shards must not be negative\n");
+        return false;
+    }
+    if (config.cancelPercent < 0 || config.cancelPercent > 100) {
+        fprintf(stderr, "--cancels must be between 0 and 100\n");
+        return false;
+    }
+    if (config.batchSize <= 0) {
+        fprintf(stderr, "--batch must be at least 1\n");
+        return false;
+    }
+    if (config.quoteReaders < 0) {
+        fprintf(stderr, "--quote-readers must not be negative\n");
+        return false;
+    }
+    if (config.snapshotMillis < 0) {
+        fprintf(stderr, "--snapshot-ms must not be negative\n");
+        return false;
+    }
+    if (config.books <= 0) {
+        fprintf(stderr, "--books must be at least 1\n");
+        return false;
+    }
+    if (config.tickers <= 0 || config.tickers > config.books) {
+        fprintf(stderr, "--tickers must be between 1 and --books\n");
+        return false;
+    }
+    if (config.arrayBooks < 0 || config.arrayBooks > config.books) {
+        fprintf(stderr, "--array-books must be between 0 and --books\n");
+        return false;
+    }
+    if (config.arrayBooks > 0 && config.shards == 0) {
+        fprintf(stderr, "--array-books needs --shards\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    SimulationConfig config;
+    if (!parseArguments(argc, argv, config)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (config.bench == BENCH_LAYOUT) {
+        runLayoutBenchmark(config);
+    } else if (config.bench == BENCH_SOA) {
+        runSoaBenchmark(config);
+    } else if (config.bench == BENCH_REPLAY_CHECK) {
+        return runReplayCheck(config) ? 0 : 1;
+    } else if (config.bench == BENCH_CANCEL_CHECK) {
+        return runCancelCheck(config) ? 0 : 1;
+    } else {
+        runSimulation(config);
+    }
+    return 0;
+}